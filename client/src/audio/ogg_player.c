@@ -4,6 +4,7 @@
  */
 
 #include "ogg_player.h"
+#include "log.h"
 
 #include "../sokol_gp/thirdparty/sokol_audio.h"
 
@@ -136,7 +137,7 @@ void push_ogg_file(ogg_audio_player* player, const char* path) {
     // Load ogg file
     player->vorbis = stb_vorbis_open_filename(path, NULL, NULL);
     if (!player->vorbis) {
-        fprintf(stderr, "Failed to open Ogg Vorbis file: %s\n", path);
+        LOG_ERROR("Failed to open Ogg Vorbis file: %s", path);
         exit(1);
     }
 
@@ -168,7 +169,7 @@ void push_ogg_file(ogg_audio_player* player, const char* path) {
         player->channels = saudio_channels();
     }
 
-    printf("Playing Ogg Vorbis file: rate=%d channels=%d length=%.2f seconds\n", 
+    LOG_INFO("Playing Ogg Vorbis file: rate=%d channels=%d length=%.2f seconds", 
         player->stream_rate, 
         player->stream_channels, 
         player->stream_len_seconds
@@ -234,7 +235,7 @@ void sfx_queue_destroy(ogg_sfx_queue *queue){
 void load_sound_into_queue(ogg_sfx_queue* queue, int sfx) {
     
     if (queue->pool_top >= SFX_POOL_SIZE) {
-        fprintf(stderr, "SFX pool full, cannot load more sounds\n");
+        LOG_ERROR("SFX pool full, cannot load more sounds");
         return;
     }
 
@@ -244,7 +245,7 @@ void load_sound_into_queue(ogg_sfx_queue* queue, int sfx) {
     int error;
     stb_vorbis* vorbis = stb_vorbis_open_filename(file, &error, NULL);
     if (!vorbis) {
-        fprintf(stderr, "Failed to open Ogg Vorbis file: %s (error %d)\n", file, error);
+        LOG_ERROR("Failed to open Ogg Vorbis file: %s (error %d)", file, error);
         return;
     }
 
@@ -7,7 +7,13 @@
 
 #include "rng.h"
 #include "tetris.h"
+#include "replay.h"
+#include "replay_archive.h"
 #include "net/client.h"
+#include "net/rollback.h"
+#include "net/spectate.h"
+#include "utils.h"
+#include "lib/tinycthread.h"
 
 #include "audio/ogg_player.h"
 #include "input/providers/input_cpu.h"
@@ -15,19 +21,28 @@
 #include "gfx/menu.h"
 #include "gfx/render.h"
 #include "input/input_table.h"
+#include "sim/sim_thread.h"
 
 #include "sokol_gp/thirdparty/sokol_app.h"
 #include <math.h>
 #include <time.h>
 #include <string.h>
 
+#define SERVER_HOST "127.0.0.1"
+#define SERVER_PORT 5000
+
+// How long leaving waits for the server to ack the goodbyes before dropping the socket
+#define LEAVE_LINGER_MS 500
+
 static udp_client net_client;
 static char net_buffer[256];
 
 typedef enum {
     GM_MARATHON,
     GM_VERSUS,
-    GM_CHALLENGE
+    GM_CHALLENGE,
+    GM_SPECTATE,
+    GM_REPLAY
 } game_mode;
 
 static game_mode current_game_mode;
@@ -35,51 +50,268 @@ static game_mode current_game_mode;
 tetris_board games[2];
 input_provider providers[2];
 
+// Step time in, whole simulation ticks out, for single player
+static tick_clock sim_clock;
+
+// The sim thread owns everything above while a game runs, what's drawn are copies of its frames
+static render_frame drawn[2];
+static int newest;
+static char has_drawn;
+static void step_game(uint32_t us, render_frame* out);
+
 ogg_audio_player player;
 
+// Single player games are recorded, the last one can be watched from the menu
+// and every one of them is kept in the archive, for replay_verify to check
+#define LAST_REPLAY_PATH "last.ntr"
+#define REPLAY_ARCHIVE_PATH "replays.nta"
+static replay_recorder recorder;
+static replay_player replay;
+
+// Has to happen before games[0] is set up again, the archive keeps the hash of how it ended
+static void stop_recording() {
+
+    if (!recorder.file)
+        return;
+
+    uint64_t hash = tetris_state_hash(&games[0]);
+    replay_record_finish(&recorder);
+    replay_archive_append_file(REPLAY_ARCHIVE_PATH, LAST_REPLAY_PATH, hash);
+}
+
+static void start_recording(const replay_settings* settings) {
+
+    if (!replay_record_start(&recorder, LAST_REPLAY_PATH, settings, now_ms()))
+        games[0].recorder = &recorder;
+}
+
+// Both boards are stepped by the rollback session, online the second one is the other client
+static rollback_session_t versus_session;
+static int versus_online = 0;
+static int versus_input_delay = ROLLBACK_DEFAULT_INPUT_DELAY;
+static char versus_started; // Online waits for the server to pair us first
+
+// Both sides have to do exactly this with the same seed
+static void setup_versus(unsigned int seed) {
+
+    rollback_init(&versus_session, seed);
+
+    tetris_init(&games[0], ROWS, COLS, seed, "Sagiri");
+    init_keyboard_provider(&providers[0]);
+    rollback_add_player(&versus_session, &games[0], ROLLBACK_LOCAL, versus_input_delay);
+
+    if (versus_online) {
+        tetris_init(&games[1], ROWS, COLS, seed, "Opponent");
+        providers[1].process_fn = NULL;
+        rollback_add_player(&versus_session, &games[1], ROLLBACK_REMOTE, 0);
+    } else {
+        tetris_init(&games[1], ROWS, COLS, seed, "CPU");
+        init_cpu_provider(&providers[1]);
+
+        // The bot reacts to what it sees, delaying it only makes it overshoot
+        rollback_add_player(&versus_session, &games[1], ROLLBACK_LOCAL, 0);
+    }
+
+    net_client.session = &versus_session;
+    versus_started = 1;
+}
+
+// Whatever we had going on with the server is over, the next online game starts on a new socket
+// so the server sees a new peer with fresh channels instead of picking up where this one left off
+static char online; // Anything went through the server on this socket
+
+static void leave_online() {
+
+    net_client.session = NULL;
+    if (!online)
+        return;
+
+    client_versus_leave(&net_client);
+    if (games[0].server)
+        tetris_bind_game(&games[0], NULL);
+
+    // Both go out reliably, closing now would take the resends with it
+    uint32_t start = now_ms();
+    while (reliable_pending(&net_client.channel) && now_ms() - start < LEAVE_LINGER_MS) {
+        client_poll(&net_client);
+        thrd_sleep(&(struct timespec) { .tv_sec = 0, .tv_nsec = 5 * 1000000 }, NULL);
+    }
+
+    client_destroy(&net_client);
+    client_init(&net_client, SERVER_HOST, SERVER_PORT);
+    online = 0;
+}
+
 void start_versus() {
 
+    sim_stop();
+    stop_recording();
+    leave_online();
     current_game_mode = GM_VERSUS;
-    
-    tetris_init(&games[0], ROWS, COLS, 0, "Sagiri");
-    tetris_bind_game(&games[0], &net_client);
-    init_keyboard_provider(&providers[0]);
+    client_spectate(&net_client, NULL);
+
+    // Online there's nothing to set up until we know the seed, see step_game
+    versus_started = 0;
+    online = versus_online;
+    if (versus_online)
+        client_versus_join(&net_client);
+    else
+        setup_versus(0);
+
+    menu_clear_stack();
+    sim_start(step_game);
+}
+
+// Watch a match the server is running, the first one going and the next once it ends
+// Boards are only ever loaded from its frames
+static spectate_client_t spectate_client;
 
-    tetris_init(&games[1], ROWS, COLS, 0, "CPU");
-    tetris_bind_game(&games[1], &net_client);
-    init_cpu_provider(&providers[1]);
+void start_spectate() {
+
+    sim_stop();
+    stop_recording();
+    leave_online();
+    current_game_mode = GM_SPECTATE;
+
+    tetris_init(&games[0], ROWS, COLS, 0, "Player 1");
+    tetris_init(&games[1], ROWS, COLS, 0, "Player 2");
+
+    spectate_client_init(&spectate_client);
+    client_spectate(&net_client, &spectate_client);
 
     menu_clear_stack();
+    sim_start(step_game);
+}
+
+void print_opponent(char* buffer, int value) {
+    snprintf(buffer, 32, "%s", value ? "Online" : "CPU");
 }
 
+number_action_desc opponent_input = {
+    .value = &versus_online,
+    .lower = 0,
+    .upper = 1,
+    .increment = 1,
+
+    .on_change = NULL,
+    .printer = &print_opponent,
+};
+
+number_action_desc input_delay_input = {
+    .value = &versus_input_delay,
+    .lower = 0,
+    .upper = ROLLBACK_MAX_INPUT_DELAY,
+    .increment = 1,
+
+    .on_change = NULL,
+    .printer = NULL,
+};
+
+menu versus_settings_menu = {
+    .items = (menu_item[]) {
+        { "Opponent",       MA_NUMBER,          .action.number = &opponent_input },
+        { "Input delay",    MA_NUMBER,          .action.number = &input_delay_input },
+        { "Go",             MA_CALLBACK,        .action.callback = start_versus },
+    },
+    .item_count = 3,
+    .selected_index = 0,
+};
+
+static int replay_speed = 1;
+number_action_desc replay_speed_input = {
+    .value = &replay_speed,
+    .lower = 1,
+    .upper = 64,
+    .increment = 1,
+
+    .on_change = NULL,
+    .printer = NULL,
+};
+
+void start_replay();
+menu replay_menu = {
+    .items = (menu_item[]) {
+        { "Speed",          MA_NUMBER,          .action.number = &replay_speed_input },
+        { "Watch last",     MA_CALLBACK,        .action.callback = start_replay },
+    },
+    .item_count = 2,
+    .selected_index = 0,
+};
+
 static int start_level = 1;
+static int marathon_online = 0;
 void start_marathon() {
 
+    sim_stop();
+    stop_recording();
+    leave_online();
     current_game_mode = GM_MARATHON;
     
-    tetris_init(&games[0], ROWS, COLS, 0, "Sagiri");
-    tetris_goto_level(&games[0], start_level);
+    // Online the server plays the same board and has the last word on it, it starts
+    // everyone on its own settings so that's what we predict from
+    replay_settings settings = {
+        .seed = 0,
+        .rows = ROWS,
+        .cols = COLS,
+        .preview_count = 3,
+        .start_level = marathon_online ? 0 : start_level,
+    };
+    replay_setup_board(&games[0], &settings, "Sagiri");
+
+    // The server records its own, ours would be rewound under it by reconciliation
+    if (marathon_online) {
+        tetris_bind_game(&games[0], &net_client);
+        online = 1;
+    } else {
+        start_recording(&settings);
+    }
 
     init_keyboard_provider(&providers[0]);
 
     menu_clear_stack();
+    sim_start(step_game);
 }
 
 static int garbage_level = 1;
 void start_challenge() {
 
+    sim_stop();
+    stop_recording();
+    leave_online();
     current_game_mode = GM_CHALLENGE;
     
-    tetris_init(&games[0], ROWS, COLS, 0, "Sagiri");
-
-    // Add some garbage lines
-    rng_table t;
-    rng_init(&t, (unsigned int)time(NULL));
-    add_garbage(&games[0], garbage_level, &t);
+    // Some garbage lines to start with
+    replay_settings settings = {
+        .seed = 0,
+        .rows = ROWS,
+        .cols = COLS,
+        .preview_count = 3,
+        .garbage_lines = garbage_level,
+        .garbage_seed = (uint32_t) time(NULL),
+    };
+    replay_setup_board(&games[0], &settings, "Sagiri");
+    start_recording(&settings);
 
     init_keyboard_provider(&providers[0]);
 
     menu_clear_stack();
+    sim_start(step_game);
+}
+
+void start_replay() {
+
+    sim_stop();
+    stop_recording();
+    leave_online();
+    replay_close(&replay);
+    if (replay_load(&replay, LAST_REPLAY_PATH))
+        return;
+
+    current_game_mode = GM_REPLAY;
+    replay_start(&replay, &games[0], "Replay");
+
+    menu_clear_stack();
+    sim_start(step_game);
 }
 
 number_action_desc level_input = {
@@ -92,12 +324,27 @@ number_action_desc level_input = {
     .printer = NULL,
 };
 
+void print_online(char* buffer, int value) {
+    snprintf(buffer, 32, "%s", value ? "Online" : "Offline");
+}
+
+number_action_desc marathon_online_input = {
+    .value = &marathon_online,
+    .lower = 0,
+    .upper = 1,
+    .increment = 1,
+
+    .on_change = NULL,
+    .printer = &print_online,
+};
+
 menu marathon_settings_menu = {
     .items = (menu_item[]) {
         { "Start level",    MA_NUMBER,          .action.number = &level_input },
+        { "Server",         MA_NUMBER,          .action.number = &marathon_online_input },
         { "Go",             MA_CALLBACK,        .action.callback = start_marathon },
     },
-    .item_count = 2,
+    .item_count = 3,
     .selected_index = 0,
 };
 
@@ -123,10 +370,12 @@ menu challenge_settings_menu = {
 menu game_menu = {
     .items = (menu_item[]) {
         { "Marathon",       MA_SUBMENU,     .action.submenu = &marathon_settings_menu },
-        { "Versus",         MA_CALLBACK,    .action.callback = start_versus },
+        { "Versus",         MA_SUBMENU,     .action.submenu = &versus_settings_menu },
         { "Challenge",      MA_SUBMENU,     .action.submenu = &challenge_settings_menu },
+        { "Spectate",       MA_CALLBACK,    .action.callback = start_spectate },
+        { "Replay",         MA_SUBMENU,     .action.submenu = &replay_menu },
     },
-    .item_count = 3,
+    .item_count = 5,
     .selected_index = 0,
 };
 
@@ -206,13 +455,14 @@ menu main_menu = {
 
 void setup_game() {
 
-    client_init(&net_client, "127.0.0.1", 5000);
+    client_init(&net_client, SERVER_HOST, SERVER_PORT);
 
     audio_init(&player, 100, 1);
     push_ogg_file(&player, "res/audio/theme2.ogg");
 
     render_init();
     menu_push(&main_menu);
+
 }
 
 void event_game(const sapp_event* event) {
@@ -223,8 +473,13 @@ void event_game(const sapp_event* event) {
 
 void cleanup_game() {
 
+    sim_stop();
+    client_versus_leave(&net_client);
     client_destroy(&net_client);
 
+    stop_recording();
+    replay_close(&replay);
+
     for (int i = 0; i < 2; i++) {
         tetris_board* game = &games[i];
         if (game->board)
@@ -235,22 +490,25 @@ void cleanup_game() {
     audio_destroy(&player);
 }
 
-void update_game() {
-    
-    float time = sapp_frame_duration();
+// One step of whatever is being played, on the sim thread
+// Left and right jump a keyframe back or ahead while watching, it plays on from there
+static void scrub_replay(tetris_board* game) {
 
-    if (menu_opened()) {
+    uint32_t step = (uint32_t) ((uint64_t) REPLAY_KEYFRAME_INTERVAL * replay.tick_rate / REPLAY_TICK_RATE);
 
-        menu* m = menu_current();
+    key_event e;
+    while (poll_key_event(&e)) {
+        if (!e.pressed)
+            continue;
 
-        render_begin();
-        render_titlescreen(time);
-
-        menu_update(m);
-        render_menu(m);
-        render_end();
-        return;
+        if (e.key == GK_LEFT)
+            replay_seek(&replay, game, replay.tick > step ? replay.tick - step : 0);
+        else if (e.key == GK_RIGHT)
+            replay_seek(&replay, game, replay.tick + step);
     }
+}
+
+static void step_game(uint32_t us, render_frame* out) {
 
     tetris_board* game;
 
@@ -259,35 +517,123 @@ void update_game() {
         case GM_CHALLENGE:
         case GM_MARATHON:
 
-            // Update the game state
+            // Update the game state, inputs first, they happened during the time being simulated
+            // Bound to the server its states come in first, so the prediction is checked right away
             game = &games[0];
-            tetris_update(game, time);
+            if (game->server)
+                client_poll(&net_client);
+
             pump_input(&providers[0], game);
+            tetris_update(game, tick_clock_advance(&sim_clock, us));
 
-            // Render the game
-            render_begin();
-            render_game(game, 0, 1);
-            render_ui(game, 0, 1);
-            render_end();
+            // Everything registered this step goes out as one packet
+            flush_inputs(game);
 
+            // Nothing else is going to happen
+            if (game->game_over)
+                stop_recording();
+
+            sim_frame_add_board(out, game);
         break;
         case GM_VERSUS:
-            // Update the game state
-            for (int i = 0; i < 2; i++) {
-                tetris_board* game = &games[i];
-                tetris_update(game, time);
-                pump_input(&providers[i], game);
+            // Opponent inputs relayed by the server
+            client_poll(&net_client);
+
+            // Nothing to show until we're paired
+            if (!versus_started) {
+                if (net_client.versus != VERSUS_PLAYING)
+                    break;
+                setup_versus(net_client.versus_seed);
             }
 
-            // Render the game
-            render_begin();
+            // They're gone, the boards stay as they were
+            if (net_client.versus == VERSUS_OVER) {
+                for (int i = 0; i < 2; i++)
+                    sim_frame_add_board(out, &games[i]);
+                break;
+            }
+
+            // Local inputs go to the session, it steps both boards in fixed ticks
+            for (int i = 0; i < 2; i++)
+                pump_input(&providers[i], &games[i]);
+
+            rollback_advance(&versus_session, us);
+            rollback_send(&versus_session, &net_client);
+
+            for (int i = 0; i < 2; i++)
+                sim_frame_add_board(out, &games[i]);
+        break;
+        case GM_SPECTATE:
+            // Frames from the server
+            client_poll(&net_client);
+
             for (int i = 0; i < 2; i++) {
-                tetris_board* game = &games[i];
-                render_game(game, i, 2);
-                render_ui(game, i, 2);
+                if (spectate_client.present & (1 << i))
+                    tetris_load_snapshot(&games[i], &spectate_client.boards[i]);
+
+                sim_frame_add_board(out, &games[i]);
             }
-            render_end();
+        break;
+        case GM_REPLAY:
+
+            game = &games[0];
+            scrub_replay(game);
+            replay_advance(&replay, game, us, (uint32_t) replay_speed);
+
+            sim_frame_add_board(out, game);
+        break;
         default:
             break;
     }
-}
\ No newline at end of file
+}
+
+void update_game() {
+    
+    float time = sapp_frame_duration();
+
+    if (menu_opened()) {
+
+        menu* m = menu_current();
+
+        render_begin();
+        render_titlescreen(time);
+
+        menu_update(m);
+        render_menu(m);
+        render_end();
+        return;
+    }
+
+    // The last two frames the sim finished, drawn somewhere in between
+    const render_frame* latest = sim_latest_frame();
+    if (latest && (!has_drawn || latest->step != drawn[newest].step)) {
+
+        // A game that just started has nothing before it
+        if (!has_drawn || latest->step < drawn[newest].step || latest->step == 0) {
+            drawn[0] = drawn[1] = *latest;
+        } else {
+            newest ^= 1;
+            drawn[newest] = *latest;
+        }
+        has_drawn = 1;
+    }
+
+    render_begin();
+    if (has_drawn) {
+
+        // One step behind the sim, alpha goes from the older frame to the newest as the next one is due
+        const render_frame* prev = &drawn[newest ^ 1];
+        const render_frame* curr = &drawn[newest];
+        float alpha = 1.0f;
+        if (curr->time > prev->time) {
+            alpha = (float) (now_us() - curr->time) / (float) (curr->time - prev->time);
+            alpha = alpha < 1.0f ? alpha : 1.0f;
+        }
+
+        for (uint8_t i = 0; i < curr->board_count && i < prev->board_count; i++) {
+            render_game(&prev->boards[i], &curr->boards[i], alpha, i, curr->board_count);
+            render_ui(&curr->boards[i], i, curr->board_count);
+        }
+    }
+    render_end();
+}
@@ -4,6 +4,7 @@
  */
 
 #include "bitmap_text.h"
+#include "log.h"
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -49,12 +50,12 @@ char bitmap_font_init(bitmap_font* font, bitmap_desc desc) {
     size_t max_value = find_max(desc.chars, desc.num_chars);
     font->char_jump_table = (size_t*) malloc((max_value + 1) * sizeof(size_t));
     if (font->char_jump_table == NULL) {
-        fprintf(stderr, "Failed to allocate memory for character jump table\n");
+        LOG_ERROR("Failed to allocate memory for character jump table");
         return 0;
     }
 
     if (!build_character_jump_table(font->char_jump_table, desc.chars, desc.num_chars)){
-        fprintf(stderr, "Failed to build character jump table\n");
+        LOG_ERROR("Failed to build character jump table");
         free(font->char_jump_table);
         return 0;
     }
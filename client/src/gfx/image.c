@@ -4,6 +4,7 @@
  */
 
 #include "image.h"
+#include "log.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -15,7 +16,7 @@ image_data load_image_from_file(const char* filepath) {
     int w,h, chn;
     unsigned char* data = stbi_load(filepath, &w, &h, &chn, RGBA_CHANNELS);
     if (data == NULL) {
-        fprintf(stderr, "Failed to load image from file: %s\n", filepath);
+        LOG_ERROR("Failed to load image from file: %s", filepath);
         exit(EXIT_FAILURE);
     }
 
@@ -46,13 +47,13 @@ sg_image create_sg_image_from_data(image_data img_data) {
 sg_image create_sg_image_from_file(const char* filepath) {
     image_data img_data = load_image_from_file(filepath);
     if (img_data.data == NULL) {
-        fprintf(stderr, "Failed to load image data from file: %s\n", filepath);
+        LOG_ERROR("Failed to load image data from file: %s", filepath);
         exit(EXIT_FAILURE);
     }
     
     sg_image img = create_sg_image_from_data(img_data);
     if (img.id == SG_INVALID_ID) {
-        fprintf(stderr, "Failed to create sg_image from data for file: %s\n", filepath);
+        LOG_ERROR("Failed to create sg_image from data for file: %s", filepath);
         stbi_image_free(img_data.data);
         exit(EXIT_FAILURE);
     }
@@ -4,6 +4,7 @@
  */
 
 #include "menu.h"
+#include "log.h"
 
 #include "../input/input_table.h"
 
@@ -19,7 +20,7 @@ void menu_push(menu* m) {
     if (g_menu_stack.top < MENU_STACK_DEPTH - 1) {
         g_menu_stack.stack[++g_menu_stack.top] = m;
     } else {
-        fprintf(stderr, "Menu stack overflow\n");
+        LOG_ERROR("Menu stack overflow");
     }
 }
 
@@ -27,7 +28,7 @@ void menu_pop() {
     if (g_menu_stack.top > 0) {
         g_menu_stack.top--;
     } else {
-        fprintf(stderr, "Menu stack underflow\n");
+        LOG_ERROR("Menu stack underflow");
     }
 }
 
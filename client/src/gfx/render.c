@@ -4,6 +4,7 @@
  */
 
 #include "render.h"
+#include "log.h"
 
 #include "../sokol_gp/thirdparty/sokol_gfx.h"
 #include "../sokol_gp/sokol_gp.h"
@@ -15,6 +16,7 @@
 #include "../core/tetris.h"
 #include "menu.h"
 
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,6 +46,9 @@
 
 #define CELL_SIZE 28
 
+// Cleared rows flash and fade out over this long
+#define LINE_CLEAR_EFFECT_TICKS (TETRIS_TICK_RATE / 4)
+
 float COLOURS[NUM_TETROMINOS + 1][3] = {
     {1, 0, 0},          // Red      (I)
     {0, 1, 0},          // Green    (J)
@@ -71,7 +76,7 @@ void render_init() {
 
     sg_image kc85_img = create_sg_image_from_file("res/fonts/kc85.png");
     if (!kc85_img.id) {
-        fprintf(stderr, "Failed to load font image\n");
+        LOG_ERROR("Failed to load font image");
         exit(EXIT_FAILURE);
     }
 
@@ -87,13 +92,13 @@ void render_init() {
         .chars = KC85_LETTER_TABLE,
         .num_chars = strlen(KC85_LETTER_TABLE),
     })) {
-        fprintf(stderr, "Failed to initialize bitmap font\n");
+        LOG_ERROR("Failed to initialize bitmap font");
         exit(EXIT_FAILURE);
     }
 
     sg_image seg_img = create_sg_image_from_file("res/fonts/7seg.png");
     if (!seg_img.id) {
-        fprintf(stderr, "Failed to load 7-segment font image\n");
+        LOG_ERROR("Failed to load 7-segment font image");
         exit(EXIT_FAILURE);
     }
 
@@ -108,13 +113,13 @@ void render_init() {
         .chars = SEGMENT_LETTER_TABLE,
         .num_chars = strlen(SEGMENT_LETTER_TABLE),
     })) {
-        fprintf(stderr, "Failed to initialize 7-segment bitmap font\n");
+        LOG_ERROR("Failed to initialize 7-segment bitmap font");
         exit(EXIT_FAILURE);
     }
 
     tile_texture = create_sg_image_from_file("res/tetris/tile_01.png");
     if (!tile_texture.id) {
-        fprintf(stderr, "Failed to load tile texture image\n");
+        LOG_ERROR("Failed to load tile texture image");
         exit(EXIT_FAILURE);
     }
 }
@@ -159,43 +164,123 @@ void render_end() {
 }
 
 /**
- * @brief Render a single cell at (x, y) with given type
+ * Cells aren't drawn one by one, every quad of a board that uses the same texture goes into
+ * one of these and out in a single sgp_draw, colours per vertex. Otherwise each cell is its
+ * own draw with its own state and sokol_gp can't merge any of them.
+ */
+#define BATCH_MAX_QUADS 256
+#define VERTICES_PER_QUAD 6
+
+_Static_assert(ROWS * COLS + 1 <= BATCH_MAX_QUADS, "A whole board and its background should fit a batch");
+
+typedef struct {
+    sg_image image; // Nothing for plain colour
+    uint32_t count;
+    sgp_vertex vertices[BATCH_MAX_QUADS * VERTICES_PER_QUAD];
+} quad_batch;
+
+static quad_batch tile_batch; // The piece, next and hold
+static quad_batch phantom_batch; // Same texture, drawn additive
+
+/**
+ * Locked cells only change when a piece locks or garbage comes in, so their quads are kept
+ * from frame to frame and only built again when the board version (or where the board is
+ * drawn) changes. The cells hash goes in the key too, a new game starts counting versions
+ * from 0 again.
+ */
+typedef struct {
+    char valid;
+    uint32_t version;
+    uint64_t hash;
+    float x;
+    float y;
+
+    quad_batch plain; // Field background and empty cells
+    quad_batch tiles; // Filled cells
+} board_layer;
+
+static board_layer layers[SIM_MAX_BOARDS];
+
+static void batch_draw(const quad_batch* batch) {
+
+    if (!batch->count)
+        return;
+
+    if (batch->image.id)
+        sgp_set_image(0, batch->image);
+    else
+        sgp_reset_image(0);
+
+    sgp_draw(SG_PRIMITIVETYPE_TRIANGLES, batch->vertices, batch->count);
+}
+
+static void batch_flush(quad_batch* batch) {
+    batch_draw(batch);
+    batch->count = 0;
+}
+
+static void batch_quad(quad_batch* batch, float x, float y, float w, float h, sgp_color_ub4 colour) {
+
+    // Never happens with a board's worth of cells, but better an extra draw than a lost quad
+    if (batch->count == BATCH_MAX_QUADS * VERTICES_PER_QUAD)
+        batch_flush(batch);
+
+    sgp_vertex corners[4] = {
+        { .position = { x, y },         .texcoord = { 0.0f, 0.0f }, .color = colour },
+        { .position = { x + w, y },     .texcoord = { 1.0f, 0.0f }, .color = colour },
+        { .position = { x + w, y + h }, .texcoord = { 1.0f, 1.0f }, .color = colour },
+        { .position = { x, y + h },     .texcoord = { 0.0f, 1.0f }, .color = colour },
+    };
+
+    sgp_vertex* v = &batch->vertices[batch->count];
+    v[0] = corners[0]; v[1] = corners[1]; v[2] = corners[2];
+    v[3] = corners[0]; v[4] = corners[2]; v[5] = corners[3];
+    batch->count += VERTICES_PER_QUAD;
+}
+
+static sgp_color_ub4 colour_ub4(float r, float g, float b, float a) {
+    return (sgp_color_ub4) {
+        (uint8_t) (r * 255.0f), (uint8_t) (g * 255.0f), (uint8_t) (b * 255.0f), (uint8_t) (a * 255.0f)
+    };
+}
+
+/**
+ * @brief Add a single cell at (x, y) with given type
  */
-void render_cell(float x, float y, int type, float alpha) {
+static void render_cell(quad_batch* batch, float x, float y, int type, float alpha) {
     
     // Get color based on tetromino type
     float r = COLOURS[type][0];
     float g = COLOURS[type][1];
     float b = COLOURS[type][2];
 
-    sgp_set_color(r, g, b, alpha);
-    sgp_draw_filled_rect(x, y, CELL_SIZE, CELL_SIZE);
+    batch_quad(batch, x, y, CELL_SIZE, CELL_SIZE, colour_ub4(r, g, b, alpha));
 }
 
 /**
- * @brief Render a tetromino piece
+ * @brief Add a tetromino piece with its row at `y`, which doesn't have to be a whole one
  */
-void render_tetromino(tetromino t, float board_x, float board_y, float alpha) {
-
-    // float board_x = (width - (10 * CELL_SIZE)) / 2.0f;
-    // float board_y = (height - (20 * CELL_SIZE)) / 2.0f;
+static void render_tetromino_at(quad_batch* batch, tetromino t, float board_x, float board_y, float y, float alpha) {
 
     for (int i = 0; i < TETRIS; i++) {
 
         position cell_position = TETROMINOS[t.type][t.rot][i];
-        position p = (position) {
-            .x = cell_position.x + t.pos.x,
-            .y = cell_position.y + t.pos.y
-        };
 
-        float cell_x = board_x + p.x * CELL_SIZE;
-        float cell_y = board_y + p.y * CELL_SIZE;
+        float cell_x = board_x + (cell_position.x + t.pos.x) * CELL_SIZE;
+        float cell_y = board_y + (cell_position.y + y) * CELL_SIZE;
 
-        render_cell(cell_x, cell_y, t.type, alpha);
+        render_cell(batch, cell_x, cell_y, t.type, alpha);
     }
 }
 
-void render_ui(const tetris_board* game, unsigned int offset, unsigned int boards) {
+/**
+ * @brief Add a tetromino piece
+ */
+static void render_tetromino(quad_batch* batch, tetromino t, float board_x, float board_y, float alpha) {
+    render_tetromino_at(batch, t, board_x, board_y, t.pos.y, alpha);
+}
+
+void render_ui(const board_frame* game, unsigned int offset, unsigned int boards) {
     
     float board_width = game->cols * CELL_SIZE;
     float board_height = game->rows * CELL_SIZE;
@@ -226,7 +311,7 @@ void render_ui(const tetris_board* game, unsigned int offset, unsigned int board
     });
 
     char score_text[32];
-    sprintf(score_text, "%06d", game->points);
+    sprintf(score_text, "%06d", game->state.points);
     sgp_set_image(0, seg_font.desc.img);
     bitmap_draw_string(&seg_font, score_text, strlen(score_text), (sgp_rect){
         .x = board_x + board_width + CELL_SIZE,
@@ -236,7 +321,7 @@ void render_ui(const tetris_board* game, unsigned int offset, unsigned int board
     });
 
     char level_text[32];
-    sprintf(level_text, "%02d", game->level);
+    sprintf(level_text, "%02d", game->state.level);
     sgp_set_image(0, kc85_font.desc.img);
     bitmap_draw_string(&kc85_font, level_text, strlen(level_text), (sgp_rect){
         .x = board_x + board_width + CELL_SIZE,
@@ -246,7 +331,7 @@ void render_ui(const tetris_board* game, unsigned int offset, unsigned int board
     });
 
     // Draw game over text
-    if (game->game_over) {
+    if (game->state.game_over) {
         const char* game_over_text = "GAME OVER";
         bitmap_draw_string(&kc85_font, game_over_text, strlen(game_over_text), (sgp_rect){
             .x = board_x + board_width / 2.0f - (strlen(game_over_text) * CELL_SIZE) / 2.0f,
@@ -261,87 +346,133 @@ void render_ui(const tetris_board* game, unsigned int offset, unsigned int board
     sgp_reset_image(0);
 }
 
-void render_game(tetris_board* game, unsigned int offset, unsigned int boards) {
-    
-    // Draw field background
-    float board_width = game->cols * CELL_SIZE;
-    float board_height = game->rows * CELL_SIZE;
+// Row the piece is drawn at, whole row plus however far gravity got it towards the next
+static float piece_row(const board_frame* b) {
 
-    float board_x = (width - board_width) / 2.0f;
-    float board_y = (height - board_height) / 2.0f;
+    float y = b->state.current.pos.y + (float) b->gravity / GRAVITY_ONE_ROW;
+    return y < b->drop.y ? y : b->drop.y;
+}
 
-    // Apply offset if more than one game is being rendered
-    int pivot = width * (2*offset + 1) / (2*boards);
-    board_x = pivot - board_width / 2;
+// Both frames show the same piece falling, anything else (moved, rotated, locked) just snaps
+static char same_fall(const board_frame* prev, const board_frame* curr) {
 
-    sgp_set_blend_mode(SGP_BLENDMODE_BLEND);
-    sgp_reset_image(0);
+    const tetromino* a = &prev->state.current;
+    const tetromino* b = &curr->state.current;
+    return a->type == b->type && a->rot == b->rot && a->pos.x == b->pos.x && a->pos.y <= b->pos.y;
+}
 
-    sgp_set_color(0.2f, 0.2f, 0.2f, 1.0f);
-    sgp_draw_filled_rect(board_x, board_y, board_width, board_height);
+// Background and locked cells, filled ones textured, empty ones a black square that leaves a border
+static void build_layer(board_layer* layer, const board_frame* game, float board_x, float board_y) {
+
+    layer->plain = (quad_batch) { .image = { SG_INVALID_ID }, .count = 0 };
+    layer->tiles.image = tile_texture;
+    layer->tiles.count = 0;
+
+    float board_width = game->cols * CELL_SIZE;
+    float board_height = game->rows * CELL_SIZE;
+    batch_quad(&layer->plain, board_x, board_y, board_width, board_height, colour_ub4(0.2f, 0.2f, 0.2f, 1.0f));
 
-    // Draw cells
     for (size_t x = 0; x < game->cols; x++) {
         for (size_t y = 0; y < game->rows; y++) {
-            int cell;
-            if ((cell = index_cell(game, x, y)) != 0) {
-                
-                sgp_set_image(0, tile_texture);
 
-                // Draw filled cell
-                float cell_x = board_x + x * CELL_SIZE;
-                float cell_y = board_y + y * CELL_SIZE;
+            float cell_x = board_x + x * CELL_SIZE;
+            float cell_y = board_y + y * CELL_SIZE;
 
-                render_cell(cell_x, cell_y, cell - 1, 1.0f);
-            } else {
+            int cell = game->state.board[x * game->rows + y];
+            if (cell != 0)
+                render_cell(&layer->tiles, cell_x, cell_y, cell - 1, 1.0f);
+            else
+                batch_quad(&layer->plain, cell_x + 1, cell_y + 1, CELL_SIZE - 2, CELL_SIZE - 2, colour_ub4(0.f, 0.f, 0.f, 1.0f));
+        }
+    }
 
-                // Unbind texture
-                sgp_reset_image(0);
+    layer->valid = 1;
+    layer->version = game->board_version;
+    layer->hash = game->cells_hash;
+    layer->x = board_x;
+    layer->y = board_y;
+}
 
-                // Draw empty cell border
-                float cell_x = board_x + x * CELL_SIZE;
-                float cell_y = board_y + y * CELL_SIZE;
+void render_game(const board_frame* prev, const board_frame* curr, float alpha, unsigned int offset, unsigned int boards) {
+    
+    // Everything that's on the board is drawn as it is in the newest frame
+    const board_frame* game = curr;
 
-                sgp_set_color(0.f, 0.f, 0.f, 1.0f);
-                sgp_draw_filled_rect(cell_x + 1, cell_y + 1, CELL_SIZE - 2, CELL_SIZE - 2);
-            }
-        }
+    // Where the field goes
+    float board_width = game->cols * CELL_SIZE;
+    float board_height = game->rows * CELL_SIZE;
+
+    float board_x = (width - board_width) / 2.0f;
+    float board_y = (height - board_height) / 2.0f;
+
+    // Apply offset if more than one game is being rendered
+    int pivot = width * (2*offset + 1) / (2*boards);
+    board_x = pivot - board_width / 2;
+
+    // Background and locked cells, kept from last frame unless they changed
+    assert(offset < SIM_MAX_BOARDS);
+    board_layer* layer = &layers[offset];
+    if (!layer->valid || layer->version != game->board_version || layer->hash != game->cells_hash ||
+        layer->x != board_x || layer->y != board_y) {
+        build_layer(layer, game, board_x, board_y);
     }
 
-    // Draw current piece
-    sgp_set_image(0, tile_texture);
+    tile_batch.image = tile_texture;
+    phantom_batch.image = tile_texture;
 
-    tetromino current = game->current;
-    render_tetromino(current, board_x, board_y, 1.0f);
+    // Current piece, falling smoothly in between the two frames
+    tetromino current = game->state.current;
+    float row = piece_row(curr);
+    if (same_fall(prev, curr))
+        row = piece_row(prev) + (row - piece_row(prev)) * alpha;
 
-    // Draw drop phantom
-    tetromino phantom = current;
-    position drop_pos = calculate_drop_preview(&game->current, game);
-    phantom.pos = drop_pos;
+    render_tetromino_at(&tile_batch, current, board_x, board_y, row, 1.0f);
 
-    sgp_set_blend_mode(SGP_BLENDMODE_ADD);
-    render_tetromino(phantom, board_x, board_y, 0.3f);
-    sgp_set_blend_mode(SGP_BLENDMODE_BLEND);
+    // Drop phantom
+    tetromino phantom = current;
+    phantom.pos = game->drop;
+    render_tetromino(&phantom_batch, phantom, board_x, board_y, 0.3f);
 
-    // Draw next piece(s)
-    for (size_t i = 0; i < game->settings.preview_count; i++) {
-        unsigned int next_type = tetris_peek_next(game, i);
-        render_tetromino((tetromino){
-            .type = next_type,
+    // Next piece(s)
+    for (size_t i = 0; i < game->preview_count; i++) {
+        render_tetromino(&tile_batch, (tetromino){
+            .type = game->preview[i],
             .rot = 0,
             .pos = (position){.x = -3, .y = 1 + (i * 4)}
         }, board_x, board_y, 1.0f);
     }
 
-    // Draw hold piece
-    if (game->has_hold) {
-        render_tetromino((tetromino){
-            .type = game->hold.type,
+    // Hold piece
+    if (game->state.has_hold) {
+        render_tetromino(&tile_batch, (tetromino){
+            .type = game->state.hold.type,
             .rot = 0,
             .pos = (position){.x = game->cols + 1, .y = 5}
         }, board_x, board_y, 1.0f);
     }
 
+    sgp_set_blend_mode(SGP_BLENDMODE_BLEND);
+    batch_draw(&layer->plain);
+    batch_draw(&layer->tiles);
+    batch_flush(&tile_batch);
+
+    // Cleared rows fade out where they were, on the tick clock in between the two frames
+    sgp_set_blend_mode(SGP_BLENDMODE_ADD);
+
+    float tick = prev->tick + (float) (curr->tick - prev->tick) * alpha;
+    float age = tick - curr->clear_tick;
+    if (curr->clear_rows && age >= 0 && age < LINE_CLEAR_EFFECT_TICKS) {
+
+        sgp_reset_image(0);
+        sgp_set_color(1.0f, 1.0f, 1.0f, 0.8f * (1.0f - age / LINE_CLEAR_EFFECT_TICKS));
+
+        for (size_t y = 0; y < game->rows && y < 32; y++)
+            if (curr->clear_rows & (1u << y))
+                sgp_draw_filled_rect(board_x, board_y + y * CELL_SIZE, board_width, CELL_SIZE);
+    }
+
+    batch_flush(&phantom_batch);
+
     sgp_reset_color();
     sgp_reset_blend_mode();
     sgp_reset_image(0);
@@ -7,6 +7,7 @@
 #define RENDER_H
 
 #include "../core/tetris.h"
+#include "../sim/sim_thread.h"
 #include "menu.h"
 
 // The piece colours
@@ -18,8 +19,9 @@ void render_destroy();
 void render_begin();
 void render_end();
 
-void render_game(tetris_board* game, unsigned int offset, unsigned int boards);
-void render_ui(const tetris_board* game, unsigned int offset, unsigned int boards);
+// A board somewhere between two frames of it, `alpha` 0 is `prev` and 1 is `curr`
+void render_game(const board_frame* prev, const board_frame* curr, float alpha, unsigned int offset, unsigned int boards);
+void render_ui(const board_frame* game, unsigned int offset, unsigned int boards);
 void render_menu(const menu *m);
 
 // Widgeting and things
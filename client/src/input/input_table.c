@@ -5,22 +5,50 @@
 
 #include "input_table.h"
 
+#include "utils.h"
+
 #include "../sokol_gp/thirdparty/sokol_app.h"
 #include <assert.h>
+#include <stdatomic.h>
 
 input_table g_input = {0};
 input_edge_table fired = {0};
 
-char is_edge_pressed(char raw, char* fired_flag) {
-    
-    if (raw && !(*fired_flag)) {
-        *fired_flag = 1;
-        return 1;
-    } else if (!raw) {
-        *fired_flag = 0;
-    }
+// Single producer (events) single consumer (the keyboard provider on the sim thread)
+static key_event key_events[KEY_EVENT_QUEUE_SIZE];
+static _Atomic uint32_t key_events_head = 0; // Next one written
+static _Atomic uint32_t key_events_tail = 0; // Next one read
+static char game_keys_down[NUM_GAME_KEYS];
+
+char poll_key_event(key_event* out) {
+
+    uint32_t tail = atomic_load_explicit(&key_events_tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&key_events_head, memory_order_acquire))
+        return 0;
+
+    *out = key_events[tail & (KEY_EVENT_QUEUE_SIZE - 1)];
+    atomic_store_explicit(&key_events_tail, tail + 1, memory_order_release);
+    return 1;
+}
 
-    return 0;
+// Only actual changes go in, os key repeats and a second key bound to the same thing don't
+static void push_key_event(game_key key, char pressed, uint64_t time) {
+
+    if (game_keys_down[key] == pressed)
+        return;
+    game_keys_down[key] = pressed;
+
+    // Nobody is taking them, in the menus
+    uint32_t head = atomic_load_explicit(&key_events_head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&key_events_tail, memory_order_acquire) == KEY_EVENT_QUEUE_SIZE)
+        return;
+
+    key_events[head & (KEY_EVENT_QUEUE_SIZE - 1)] = (key_event) {
+        .time = time,
+        .key = (uint8_t) key,
+        .pressed = pressed,
+    };
+    atomic_store_explicit(&key_events_head, head + 1, memory_order_release);
 }
 
 /**
@@ -31,40 +59,55 @@ void handle_kb_input_event(const sapp_event* event) {
     if (event->type == SAPP_EVENTTYPE_KEY_DOWN || event->type == SAPP_EVENTTYPE_KEY_UP) {
         bool pressed = (event->type == SAPP_EVENTTYPE_KEY_DOWN);
 
+        // As early as we get to see it, the frame it's handled in could be a while later
+        uint64_t time = now_us();
+
         switch (event->key_code) {
             case SAPP_KEYCODE_A:
             case SAPP_KEYCODE_LEFT: 
                 g_input.left   = pressed; 
                 g_input.ui_left = pressed;
+                push_key_event(GK_LEFT, pressed, time);
                 break;
             case SAPP_KEYCODE_D: 
             case SAPP_KEYCODE_RIGHT: 
                 g_input.right  = pressed; 
                 g_input.ui_right  = pressed; 
+                push_key_event(GK_RIGHT, pressed, time);
                 break;
             case SAPP_KEYCODE_S: 
             case SAPP_KEYCODE_DOWN: 
                 g_input.down   = pressed; 
                 g_input.ui_down = pressed;
+                push_key_event(GK_DOWN, pressed, time);
                 break;
             case SAPP_KEYCODE_Z: 
                 g_input.lrotate  = pressed; 
                 g_input.ui_select = pressed;
+                push_key_event(GK_LROTATE, pressed, time);
                 break;
             case SAPP_KEYCODE_LEFT_CONTROL:
             case SAPP_KEYCODE_X: 
                 g_input.rrotate  = pressed; 
                 g_input.ui_back  = pressed;
+                push_key_event(GK_RROTATE, pressed, time);
+                break;
+            case SAPP_KEYCODE_R:
+                g_input.reset  = pressed;
+                push_key_event(GK_RESET, pressed, time);
                 break;
-            case SAPP_KEYCODE_R: g_input.reset  = pressed; break;
             case SAPP_KEYCODE_UP:
             case SAPP_KEYCODE_W: 
                 g_input.drop   = pressed; 
                 g_input.ui_up = pressed;
+                push_key_event(GK_DROP, pressed, time);
                 break;
             case SAPP_KEYCODE_C:
             case SAPP_KEYCODE_SPACE:
-            case SAPP_KEYCODE_LEFT_SHIFT: g_input.hold   = pressed; break;
+            case SAPP_KEYCODE_LEFT_SHIFT:
+                g_input.hold   = pressed;
+                push_key_event(GK_HOLD, pressed, time);
+                break;
             case SAPP_KEYCODE_ESCAPE:
                 if (pressed) {
                     sapp_request_quit();
@@ -6,6 +6,8 @@
 #ifndef INPUT_TABLE_H
 #define INPUT_TABLE_H
 
+#include <stdint.h>
+
 struct sapp_event;
 
 /**
@@ -54,6 +56,22 @@ typedef struct {
     char ui_back_edge;
 } input_edge_table;
 
+/**
+ * Game keys as they happened, timestamped when the event comes in rather than whenever
+ * the next frame gets to them, so the keyboard provider can replay them in order
+ */
+typedef enum {
+    GK_LEFT, GK_RIGHT, GK_DOWN, GK_LROTATE, GK_RROTATE, GK_RESET, GK_DROP, GK_HOLD, NUM_GAME_KEYS
+} game_key;
+
+typedef struct {
+    uint64_t time; // now_us clock
+    uint8_t key;
+    char pressed;
+} key_event;
+
+#define KEY_EVENT_QUEUE_SIZE 64 // Power of two, new ones are dropped if nobody takes them
+
 // Input tables
 extern input_table g_input;
 extern input_edge_table fired;
@@ -63,5 +81,8 @@ void handle_kb_input_event(const struct sapp_event* event);
 
 char is_edge_pressed(char raw, char* fired_flag);
 
+// Oldest key event not taken yet, returns 0 if there are none
+char poll_key_event(key_event* out);
+
 
 #endif
\ No newline at end of file
@@ -6,42 +6,171 @@
 #include "input_keyboard.h"
 
 #include "tetris.h"
+#include "utils.h"
 
 #include "../../sokol_gp/thirdparty/sokol_app.h"
 #include "../../input/input_table.h"
 
 /**
- * @brief Process the current input state into game actions
+ * Left and right go through DAS/ARR: a press moves once right away, held for `das` it
+ * starts repeating every `arr`, and an ARR of 0 puts the piece against the wall at once
+ * and keeps it there, new pieces included. With both held the last one pressed wins,
+ * letting go of it goes back to the other one with a fresh DAS.
+ *
+ * It all runs on the times the key events came in with, not on the frame they're handled
+ * in, and every input goes out with the time it should have happened at. A slow frame only
+ * delays when they're applied, not how they're spaced out.
  */
-void process_game_keyboard_state(tetris_board* game) {
-    
-    if (g_input.left)  register_input(IE_MOVE_LEFT, game);
-    if (g_input.right) register_input(IE_MOVE_RIGHT, game);
-    if (g_input.down)  register_input(IE_DROP, game);
+typedef struct {
+    char held[NUM_GAME_KEYS];
+
+    int direction; // -1, 1, or 0 for none
+    uint64_t next_shift; // When the held direction moves next, now_us clock
+    char at_wall; // 0 ARR and DAS is over
+
+    uint64_t next_drop;
+
+    int pending_dx; // Moves registered since the last frame, not applied yet
+} keyboard_state;
+
+static keyboard_state state;
+
+static const input_event_type ONE_SHOTS[NUM_GAME_KEYS] = {
+    [GK_LROTATE] = IE_ROTATE_LEFT,
+    [GK_RROTATE] = IE_ROTATE_RIGHT,
+    [GK_RESET] = IE_RESET,
+    [GK_DROP] = IE_HARD_DROP,
+    [GK_HOLD] = IE_HOLD,
+};
+
+static uint64_t ticks_to_us(uint32_t ticks) {
+    return (uint64_t) ticks * 1000000 / TETRIS_TICK_RATE;
+}
+
+static void emit(tetris_board* game, input_event_type action, uint64_t time) {
+    register_input_at(action, game, (uint32_t) (time / 1000));
+}
+
+static void shift(tetris_board* game, uint64_t time) {
+    emit(game, state.direction < 0 ? IE_MOVE_LEFT : IE_MOVE_RIGHT, time);
+    state.pending_dx += state.direction;
+}
+
+// As many moves as it takes to reach the wall from where the piece will be
+static void shift_to_wall(tetris_board* game, uint64_t time) {
+
+    tetromino probe = game->current;
+    probe.pos.x += state.pending_dx;
+
+    while (move_tetromino(game, &probe, state.direction, 0) == 1)
+        shift(game, time);
+}
+
+static void start_direction(tetris_board* game, int direction, uint64_t time, char move_now) {
+
+    state.direction = direction;
+    state.next_shift = time + ticks_to_us(game->settings.das);
+    state.at_wall = 0;
 
-    // one-shots
-    if (is_edge_pressed(g_input.lrotate, &fired.lrotate_edge))
-        register_input(IE_ROTATE_LEFT, game);
+    if (move_now)
+        shift(game, time);
+}
+
+// Everything that comes due up to `until`, oldest first
+static void advance(tetris_board* game, uint64_t until) {
+
+    for (;;) {
+        uint64_t next_shift = state.direction && !state.at_wall ? state.next_shift : UINT64_MAX;
+        uint64_t next_drop = state.held[GK_DOWN] ? state.next_drop : UINT64_MAX;
+
+        if (next_shift <= next_drop && next_shift <= until) {
+
+            if (game->settings.arr) {
+                shift(game, next_shift);
+                state.next_shift += ticks_to_us(game->settings.arr);
+            } else {
+                shift_to_wall(game, next_shift);
+                state.at_wall = 1;
+            }
+
+        } else if (next_drop <= until) {
+            emit(game, IE_DROP, next_drop);
+            state.next_drop += DROP_COOLDOWN_MS * 1000;
+        } else {
+            break;
+        }
+    }
+
+    // The piece may have changed since, keep it pushed over
+    if (state.direction && state.at_wall)
+        shift_to_wall(game, until);
+}
+
+static void handle_key_event(tetris_board* game, const key_event* event) {
 
-    if (is_edge_pressed(g_input.rrotate, &fired.rrotate_edge))
-        register_input(IE_ROTATE_RIGHT, game);
+    game_key key = (game_key) event->key;
 
-    if (is_edge_pressed(g_input.hold, &fired.hold_edge))
-        register_input(IE_HOLD, game);
+    // Releases of keys pressed before we started listening
+    if (!event->pressed && !state.held[key])
+        return;
+    state.held[key] = event->pressed;
 
-    if (is_edge_pressed(g_input.reset, &fired.reset_edge))
-        register_input(IE_RESET, game);
+    switch (key) {
+        case GK_LEFT:
+        case GK_RIGHT: {
+            int direction = key == GK_LEFT ? -1 : 1;
+            if (event->pressed) {
+                start_direction(game, direction, event->time, 1);
+            } else if (state.direction == direction) {
+                game_key other = key == GK_LEFT ? GK_RIGHT : GK_LEFT;
+                if (state.held[other])
+                    start_direction(game, -direction, event->time, 0);
+                else
+                    state.direction = 0;
+            }
+            break;
+        }
+        case GK_DOWN:
+            if (event->pressed) {
+                emit(game, IE_DROP, event->time);
+                state.next_drop = event->time + DROP_COOLDOWN_MS * 1000;
+            }
+            break;
+        default:
+            if (event->pressed)
+                emit(game, ONE_SHOTS[key], event->time);
+            break;
+    }
+}
+
+/**
+ * @brief Turn the key events since last frame into game actions
+ */
+void process_game_keyboard_state(tetris_board* game) {
 
-    if (is_edge_pressed(g_input.drop, &fired.drop_edge))
-        register_input(IE_HARD_DROP, game);
+    state.pending_dx = 0;
+
+    // Repeats that came due before each event go in before it
+    key_event event;
+    while (poll_key_event(&event)) {
+        advance(game, event.time);
+        handle_key_event(game, &event);
+    }
+
+    advance(game, now_us());
 }
 
 void init_keyboard_provider(input_provider *provider) {
 
     provider->type = INPUT_PROVIDER_KEYBOARD;
     provider->process_fn = process_game_keyboard_state;
+
+    // Whatever was pressed in the menus isn't for the game
+    key_event event;
+    while (poll_key_event(&event));
+    state = (keyboard_state) {0};
 }
 
 void cleanup_keyboard_provider(input_provider* provider) {
     // pass
-}
\ No newline at end of file
+}
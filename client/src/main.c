@@ -20,6 +20,7 @@
 #include <math.h>
 
 #include "game.h"
+#include "log.h"
 
 #define TARGET_WINDOW_WIDTH 1280
 #define TARGET_WINDOW_HEIGHT 720
@@ -39,7 +40,7 @@ static void init(void) {
     sg_setup(&sgdesc);
 
     if (!sg_isvalid()) {
-        fprintf(stderr, "Failed to create Sokol GFX context!\n");
+        LOG_ERROR("Failed to create Sokol GFX context!");
         exit(EXIT_FAILURE);
     }
 
@@ -47,7 +48,7 @@ static void init(void) {
     sgp_desc sgpdesc = {0};
     sgp_setup(&sgpdesc);
     if (!sgp_is_valid()) {
-        fprintf(stderr, "Failed to create Sokol GP context: %s\n", sgp_get_error_message(sgp_get_last_error()));
+        LOG_ERROR("Failed to create Sokol GP context: %s", sgp_get_error_message(sgp_get_last_error()));
         exit(EXIT_FAILURE);
     }
 
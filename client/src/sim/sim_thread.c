@@ -0,0 +1,130 @@
+/**
+ * @file        sim_thread.c
+ * @brief       Game simulation on its own fixed rate thread
+ */
+
+#include "sim_thread.h"
+
+#include "utils.h"
+#include "lib/tinycthread.h"
+
+#include <stdatomic.h>
+
+/**
+ * Three frames, one each for the sim to write, the renderer to read, and one in the middle.
+ * Handing over is swapping your own for the middle one, the fresh bit says whether what's
+ * in the middle was put there by the sim since the renderer last took it.
+ */
+#define SLOT_MASK 3
+#define SLOT_FRESH 4
+
+static render_frame frames[3];
+static _Atomic unsigned int middle;
+static unsigned int back; // Sim thread's
+static unsigned int front; // Render thread's
+static char has_front;
+
+static sim_step_func step_fn;
+static thrd_t thread;
+static _Atomic char running;
+
+static void publish(void) {
+    unsigned int prev = atomic_exchange_explicit(&middle, back | SLOT_FRESH, memory_order_acq_rel);
+    back = prev & SLOT_MASK;
+}
+
+static int sim_loop(void* arg) {
+
+    (void) arg;
+
+    uint64_t steps = 0;
+    uint64_t last = now_us();
+    uint64_t next = last;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+
+        // Real time since the last step, not the nominal one, a late step catches up
+        uint64_t now = now_us();
+        uint32_t us = (uint32_t) (now - last);
+        last = now;
+
+        render_frame* frame = &frames[back];
+        frame->step = steps++;
+        frame->board_count = 0;
+        step_fn(us, frame);
+        frame->time = now_us();
+        publish();
+
+        // Sleep until the next one is due, if we're already late just keep going
+        next += SIM_STEP_US;
+        uint64_t after = now_us();
+        if (next > after)
+            thrd_sleep(&(struct timespec) { .tv_sec = 0, .tv_nsec = (long) (next - after) * 1000 }, NULL);
+        else
+            next = after;
+    }
+
+    return 0;
+}
+
+void sim_start(sim_step_func step) {
+
+    sim_stop();
+
+    // Nothing in the middle, the renderer shows nothing until the first step is done
+    back = 0;
+    atomic_store_explicit(&middle, 1, memory_order_relaxed);
+    front = 2;
+    has_front = 0;
+
+    step_fn = step;
+    atomic_store_explicit(&running, 1, memory_order_relaxed);
+    thrd_create(&thread, sim_loop, NULL);
+}
+
+void sim_stop(void) {
+
+    if (!atomic_load_explicit(&running, memory_order_relaxed))
+        return;
+
+    atomic_store_explicit(&running, 0, memory_order_relaxed);
+    thrd_join(thread, NULL);
+}
+
+const render_frame* sim_latest_frame(void) {
+
+    if (atomic_load_explicit(&middle, memory_order_acquire) & SLOT_FRESH) {
+        unsigned int prev = atomic_exchange_explicit(&middle, front, memory_order_acq_rel);
+        front = prev & SLOT_MASK;
+        has_front = 1;
+    }
+
+    return has_front ? &frames[front] : NULL;
+}
+
+void sim_frame_add_board(render_frame* frame, tetris_board* game) {
+
+    if (frame->board_count == SIM_MAX_BOARDS)
+        return;
+
+    board_frame* board = &frame->boards[frame->board_count++];
+    tetris_save_snapshot(game, &board->state);
+    board->name = game->name;
+    board->rows = (uint8_t) game->rows;
+    board->cols = (uint8_t) game->cols;
+
+    board->preview_count = game->settings.preview_count;
+    if (board->preview_count > SIM_MAX_PREVIEW)
+        board->preview_count = SIM_MAX_PREVIEW;
+    for (unsigned int i = 0; i < board->preview_count; i++)
+        board->preview[i] = tetris_peek_next(game, i);
+    board->drop = calculate_drop_preview(&game->current, game);
+
+    board->board_version = game->board_version;
+    board->cells_hash = game->cells_hash;
+
+    board->tick = game->counters.tick;
+    board->gravity = game->counters.gravity;
+    board->clear_rows = game->counters.clear_rows;
+    board->clear_tick = game->counters.clear_tick;
+}
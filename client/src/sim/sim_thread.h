@@ -0,0 +1,71 @@
+/**
+ * @file        sim_thread.h
+ * @brief       Game simulation on its own fixed rate thread
+ */
+
+#ifndef SIM_THREAD_H
+#define SIM_THREAD_H
+
+#include "tetris.h"
+
+#include <stdint.h>
+
+/**
+ * The simulation (input, bot, network, ticking the boards) runs SIM_RATE times a second on
+ * its own thread, no matter how fast or slow frames are drawn. At the end of every step it
+ * copies what there is to draw into a render_frame and hands it over through a triple buffer:
+ * the sim always has a free frame to write, the renderer always has the newest finished one
+ * to read, and neither ever waits on the other. Frames are never written once handed over.
+ *
+ * Anything the sim thread touches (the boards, providers, the net client) belongs to it while
+ * it runs, set things up between sim_stop and sim_start.
+ */
+#define SIM_RATE 120
+#define SIM_STEP_US (1000000 / SIM_RATE)
+
+#define SIM_MAX_BOARDS 2
+#define SIM_MAX_PREVIEW 6
+
+// A board as it was at the end of a step, with everything drawing it needs worked out
+typedef struct {
+    tetris_snapshot state;
+    const char* name;
+    uint8_t rows;
+    uint8_t cols;
+
+    unsigned int preview_count;
+    tetromino_type preview[SIM_MAX_PREVIEW];
+    position drop; // Where the current piece lands
+
+    // Locked cells only change when these do
+    uint32_t board_version;
+    uint64_t cells_hash;
+
+    uint32_t tick;
+    uint32_t gravity; // Fixed point, how far the piece is below its row
+    uint32_t clear_rows; // Last line clear, see tetris_counters
+    uint32_t clear_tick;
+} board_frame;
+
+typedef struct {
+    uint64_t step; // Steps since the sim started
+    uint64_t time; // now_us when it was taken
+    uint8_t board_count;
+    board_frame boards[SIM_MAX_BOARDS];
+} render_frame;
+
+// Advance everything by `us` microseconds and describe the result in `out`
+typedef void (*sim_step_func)(uint32_t us, render_frame* out);
+
+void sim_start(sim_step_func step);
+// Waits for the step in progress, does nothing if it isn't running
+void sim_stop(void);
+
+// Newest finished frame, valid until the next call, NULL if there's none since sim_start
+// Render thread only
+const render_frame* sim_latest_frame(void);
+
+// Adds the board at the end of `frame`
+void sim_frame_add_board(render_frame* frame, tetris_board* game);
+
+#endif
@@ -4,7 +4,6 @@
  */
 
 #include "input.h"
-#include "queue/queue.h"
 #include "tetris.h"
 #include "net/client.h"
 #include "utils.h"
@@ -18,10 +17,21 @@
 int validate_input(input_validator_t* v, input_event_type action, uint32_t now) {
     switch (action) {
         case IE_MOVE_LEFT:
-        case IE_MOVE_RIGHT:
-            if ((now - v->last_move_time) < MOVE_COOLDOWN_MS) return 0;
-            v->last_move_time = now;
+        case IE_MOVE_RIGHT: {
+            // Whole refills only, the rest of the interval carries over
+            uint32_t refill = (now - v->last_move_time) / MOVE_RATE_MS;
+            if (v->move_tokens + refill >= MOVE_BURST) {
+                v->move_tokens = MOVE_BURST;
+                v->last_move_time = now;
+            } else {
+                v->move_tokens += refill;
+                v->last_move_time += refill * MOVE_RATE_MS;
+            }
+
+            if (!v->move_tokens) return 0;
+            v->move_tokens--;
             return 1;
+        }
         case IE_DROP:
             if ((now - v->last_drop_time) < DROP_COOLDOWN_MS) return 0;
             v->last_drop_time = now;
@@ -31,26 +41,108 @@ int validate_input(input_validator_t* v, input_event_type action, uint32_t now)
     }
 }
 
+uint8_t validate_input_batch(input_validator_t* v, uint8_t* actions, uint32_t* times, uint8_t count) {
+
+    uint8_t kept = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        if (!validate_input(v, actions[i], times[i]))
+            continue;
+
+        actions[kept] = actions[i];
+        times[kept] = times[i];
+        kept++;
+    }
+
+    return kept;
+}
+
 void register_input(input_event_type action, tetris_board* game) {
- 
-    if (!validate_input(&game->validator, action, now_ms())) return;
+    register_input_at(action, game, now_ms());
+}
+
+void register_input_at(input_event_type action, tetris_board* game, uint32_t now) {
+
+    // Bound boards validate on the session clock, the same times the server checks them with
+    if (game->server)
+        now -= game->net.start_time;
+
+    if (!validate_input(&game->validator, action, now)) return;
 
     // Use socket if provided
-    if(!enqueue(&game->input_queue, action)) {
-        // Handle this maybe?
+    input_record record = {
+        .tick = now,
+        .seq = game->input_seq,
+        .action = (uint8_t) action,
+        .source = INPUT_SOURCE_LOCAL,
+    };
+
+    if(!mpsc_push(&game->input_queue, record)) {
+        // Never applied, so it must not get a sequence number either
+        return;
     }
+    game->input_seq++;
 
-    // Relay input to server if available
+    // Keep it around for the server, it goes out on the next flush
     if (game->server) {
-        client_send(game->server, &(packet_types_t) {
-            .type = PACKET_TYPE_SEND_INPUT,
-            .send_input = {
-                .input = action,
-                .username = strdup(game->name),
-                .input_time = now_ms()
-            },
-        });
+        uint32_t i = game->net.next_seq++ & (INPUT_HISTORY_SIZE - 1);
+        game->net.history_action[i] = action;
+        game->net.history_time[i] = now;
+    }
+}
+
+void flush_inputs(tetris_board* game) {
+
+    if (!game->server) return;
+
+    uint32_t now = now_ms();
+    char has_new = game->net.flushed_seq != game->net.next_seq;
+    char has_unacked = game->net.acked_seq != game->net.next_seq;
+
+    if (!has_new && !(has_unacked && now - game->net.last_send_time >= INPUT_RESEND_MS))
+        return;
+
+    // Everything not acked yet goes out again, oldest first, whatever doesn't fit waits for the
+    // next flush. Only what the history already overwrote is gone, the server will say so
+    uint32_t first = game->net.acked_seq;
+    if (game->net.next_seq - first > INPUT_HISTORY_SIZE)
+        first = game->net.next_seq - INPUT_HISTORY_SIZE;
+
+    packet_types_t packet = {
+        .type = PACKET_TYPE_SEND_INPUT,
+        .send_input = {
+            .player = game->net.player_id,
+            .inputs = { .first_seq = first },
+            .hash_seq = game->net.applied_seq,
+            .hash = tetris_state_hash(game),
+        },
+    };
+
+    input_batch_t* batch = &packet.send_input.inputs;
+    uint32_t seq = first;
+    for (; seq != game->net.next_seq; seq++) {
+        uint32_t i = seq & (INPUT_HISTORY_SIZE - 1);
+        uint8_t n = batch->count;
+
+        // Gravity is a row per input, a run of them goes as one entry
+        if (n && game->net.history_action[i] == IE_GRAVITY && batch->action[n - 1] == IE_GRAVITY
+            && batch->rows[n - 1] < MAX_GRAVITY_RUN) {
+            batch->rows[n - 1]++;
+            continue;
+        }
+
+        if (n == MAX_BATCH_INPUTS) break;
+
+        batch->action[n] = game->net.history_action[i];
+        batch->rows[n] = 1;
+        batch->time[n] = game->net.history_time[i];
+        batch->count++;
     }
+
+    client_send(game->server, &packet);
+
+    if ((int32_t) (seq - game->net.flushed_seq) > 0)
+        game->net.flushed_seq = seq;
+    game->net.last_send_time = now;
 }
 
 // Dispatch input processing to the appropriate input provider
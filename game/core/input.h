@@ -6,11 +6,12 @@
 #ifndef INPUT_H
 #define INPUT_H
 
-#include "queue/queue.h"
-
 #include <stdint.h>
 
-#define MOVE_COOLDOWN_MS 80
+// Moves are rate limited as a bucket: MOVE_BURST of them back to back (an instant shift
+// across the whole board), then one every MOVE_RATE_MS as it refills
+#define MOVE_RATE_MS 16
+#define MOVE_BURST 10
 #define DROP_COOLDOWN_MS 30
 
 struct tetris_board;
@@ -23,6 +24,9 @@ typedef enum {
     IE_GRAVITY, IE_MOVE_LEFT, IE_MOVE_RIGHT, IE_DROP, IE_ROTATE_LEFT, IE_ROTATE_RIGHT, IE_HARD_DROP, IE_HOLD, IE_RESET
 } input_event_type;
 
+// Opcodes go on the wire as 4 bits, keep this bellow 16
+#define NUM_INPUT_EVENTS (IE_RESET + 1)
+
 /**
  * Who implements the dang input
  */
@@ -46,13 +50,27 @@ typedef struct {
 void pump_input(input_provider* provider, struct tetris_board* game);
 // Register an input event into the input queue
 void register_input(input_event_type action, struct tetris_board* game);
+// Same, for an input that happened at `time` (now_ms clock) instead of right now
+// Inputs of a board have to be registered in the order they happened
+void register_input_at(input_event_type action, struct tetris_board* game, uint32_t time);
+// Send this frame's inputs to the server in a single packet, call once per frame
+void flush_inputs(struct tetris_board* game);
+
+// Unacked inputs are resent after this long even without new input
+#define INPUT_RESEND_MS 50
 
 // Verify if input is valid
 typedef struct input_validator {
-    uint32_t last_move_time;
+    uint32_t last_move_time; // Last time the move bucket refilled
+    uint8_t move_tokens;
     uint32_t last_drop_time;
 } input_validator_t;
 
+// `now` is whatever clock the inputs are timestamped with, only differences matter
 int validate_input(input_validator_t* v, input_event_type action, uint32_t now);
 
+// Validate a run of inputs in order using the times they were made at, not when they arrived
+// Rejected ones are dropped and the rest moved to the front, returns how many are left
+uint8_t validate_input_batch(input_validator_t* v, uint8_t* actions, uint32_t* times, uint8_t count);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+/**
+ * @file        log.c
+ * @brief       Leveled asynchronous logging
+ */
+
+#include "log.h"
+#include "lib/tinycthread.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LOG_MASK (LOG_RING_SIZE - 1)
+#define LOG_IDLE_NS 2000000 // Writer naps this long when there's nothing to write
+
+static const char* LEVEL_NAMES[] = { "DEBUG", "INFO", "WARN", "ERROR" };
+
+// Same scheme as the input rings, any thread writes, only the writer thread reads
+typedef struct {
+    _Atomic uint32_t seq;
+    uint8_t level;
+    char message[LOG_MESSAGE_SIZE];
+} log_line;
+
+static struct {
+    _Alignas(64) _Atomic uint32_t tail;
+    _Alignas(64) uint32_t head;
+    _Atomic unsigned int dropped;
+    log_line lines[LOG_RING_SIZE];
+} ring;
+
+static once_flag started = ONCE_FLAG_INIT;
+static thrd_t writer;
+static atomic_char running;
+
+// Write out everything published so far, returns how many lines that was
+static int drain(void) {
+
+    int written = 0;
+    for (;;) {
+        log_line* line = &ring.lines[ring.head & LOG_MASK];
+        if ((int32_t) (atomic_load_explicit(&line->seq, memory_order_acquire) - (ring.head + 1)) < 0)
+            break;
+
+        FILE* out = line->level >= LOG_LEVEL_WARN ? stderr : stdout;
+        fprintf(out, "[%s] %s\n", LEVEL_NAMES[line->level], line->message);
+
+        atomic_store_explicit(&line->seq, ring.head + LOG_RING_SIZE, memory_order_release);
+        ring.head++;
+        written++;
+    }
+
+    return written;
+}
+
+static int writer_loop(void* arg) {
+
+    (void) arg;
+    unsigned int reported = 0;
+
+    while (atomic_load_explicit(&running, memory_order_acquire)) {
+
+        if (drain())
+            continue;
+
+        unsigned int dropped = atomic_load_explicit(&ring.dropped, memory_order_relaxed);
+        if (dropped != reported) {
+            fprintf(stderr, "[WARN] log ring full, dropped %u lines\n", dropped - reported);
+            reported = dropped;
+        }
+
+        // Nothing to do, good time to push it out
+        fflush(stdout);
+        thrd_sleep(&(struct timespec) { .tv_sec = 0, .tv_nsec = LOG_IDLE_NS }, NULL);
+    }
+
+    drain();
+    fflush(stdout);
+    return 0;
+}
+
+static void log_stop(void) {
+    atomic_store_explicit(&running, 0, memory_order_release);
+    thrd_join(writer, NULL);
+}
+
+static void log_start(void) {
+
+    for (uint32_t i = 0; i < LOG_RING_SIZE; i++)
+        atomic_store_explicit(&ring.lines[i].seq, i, memory_order_relaxed);
+
+    atomic_store_explicit(&running, 1, memory_order_release);
+    if (thrd_create(&writer, writer_loop, NULL) != thrd_success)
+        return;
+
+    atexit(log_stop);
+}
+
+void log_write(int level, const char* format, ...) {
+
+    call_once(&started, log_start);
+
+    uint32_t pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    log_line* line;
+
+    for (;;) {
+        line = &ring.lines[pos & LOG_MASK];
+        int32_t diff = (int32_t) (atomic_load_explicit(&line->seq, memory_order_acquire) - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring.tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+            return;
+        } else {
+            pos = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+        }
+    }
+
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line->message, sizeof(line->message), format, args);
+    va_end(args);
+
+    line->level = (uint8_t) level;
+    atomic_store_explicit(&line->seq, pos + 1, memory_order_release);
+}
+
+unsigned int log_dropped(void) {
+    return atomic_load_explicit(&ring.dropped, memory_order_relaxed);
+}
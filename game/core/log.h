@@ -0,0 +1,69 @@
+/**
+ * @file        log.h
+ * @brief       Leveled asynchronous logging
+ */
+
+#ifndef LOG_H
+#define LOG_H
+
+/**
+ * Lines are formatted on the calling thread into a lock-free ring and written out by a
+ * background thread, so logging never waits on the terminal. If the ring is full the
+ * line is dropped and counted, it never blocks either.
+ *
+ * Anything bellow LOG_LEVEL is compiled out entirely, arguments included, so debug
+ * logging costs nothing unless it's built in: -DLOG_LEVEL=LOG_LEVEL_DEBUG
+ */
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_ENABLED(level) ((level) >= LOG_LEVEL)
+
+#define LOG_RING_SIZE 1024 // Lines in flight, power of two
+#define LOG_MESSAGE_SIZE 192 // Longer ones get cut
+
+#if LOG_ENABLED(LOG_LEVEL_DEBUG)
+#define LOG_DEBUG(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void) 0)
+#endif
+
+#if LOG_ENABLED(LOG_LEVEL_INFO)
+#define LOG_INFO(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void) 0)
+#endif
+
+#if LOG_ENABLED(LOG_LEVEL_WARN)
+#define LOG_WARN(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) ((void) 0)
+#endif
+
+#if LOG_ENABLED(LOG_LEVEL_ERROR)
+#define LOG_ERROR(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) ((void) 0)
+#endif
+
+#ifdef __GNUC__
+#define LOG_FORMAT __attribute__((format(printf, 2, 3)))
+#else
+#define LOG_FORMAT
+#endif
+
+// Use the macros, they're what gets stripped. The writer thread starts on the first line
+// and everything still queued is written out at exit
+void log_write(int level, const char* format, ...) LOG_FORMAT;
+
+// Lines lost to a full ring so far
+unsigned int log_dropped(void);
+
+#endif
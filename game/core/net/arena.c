@@ -0,0 +1,30 @@
+/**
+ * @file        arena.c
+ * @brief       Bump allocator over caller-provided memory
+ */
+
+#include "arena.h"
+
+// Keep allocations pointer aligned so anything can live in the arena
+#define ARENA_ALIGN (sizeof(void*))
+
+void arena_init(arena_t* a, void* storage, size_t capacity) {
+
+    a->data = (uint8_t*) storage;
+    a->capacity = capacity;
+    a->used = 0;
+}
+
+void* arena_alloc(arena_t* a, size_t n) {
+
+    size_t start = (a->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if (start + n > a->capacity)
+        return NULL;
+
+    a->used = start + n;
+    return a->data + start;
+}
+
+void arena_reset(arena_t* a) {
+    a->used = 0;
+}
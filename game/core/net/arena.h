@@ -0,0 +1,31 @@
+/**
+ * @file        arena.h
+ * @brief       Bump allocator over caller-provided memory
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A bump arena never owns its memory, the caller hands it a block (usually on the stack)
+ * and resets it once the data is no longer needed, e.g. once per server tick.
+ * Allocations are never freed individually, so the packet path never touches the heap
+ */
+typedef struct {
+    uint8_t* data;
+    size_t capacity;
+    size_t used;
+} arena_t;
+
+void arena_init(arena_t* a, void* storage, size_t capacity);
+
+// Returns NULL when the arena is exhausted
+void* arena_alloc(arena_t* a, size_t n);
+
+// Forget every allocation, the memory is reused from the start
+void arena_reset(arena_t* a);
+
+#endif
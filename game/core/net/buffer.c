@@ -60,5 +60,158 @@ int read_bytes(reader_t* r, void* dest, size_t n) {
     memcpy(dest, r->data + r->pos, n);
     r->pos += n;
 
+    return 0;
+}
+
+// Up front bound checks
+int buffer_reserve(buffer_t* b, size_t n) {
+    return b->size + n > b->capacity;
+}
+
+int reader_require(reader_t* r, size_t n) {
+    return r->pos + n > r->size;
+}
+
+// Unchecked writes, only call after buffer_reserve
+void put_bytes(buffer_t* b, const void* src, size_t n) {
+    memcpy(b->data + b->size, src, n);
+    b->size += n;
+}
+
+void put_u16(buffer_t* b, uint16_t v) {
+    v = htons(v);
+    put_bytes(b, &v, sizeof(v));
+}
+
+void put_u32(buffer_t* b, uint32_t v) {
+    v = htonl(v);
+    put_bytes(b, &v, sizeof(v));
+}
+
+// Unchecked reads, only call after reader_require
+void get_bytes(reader_t* r, void* dest, size_t n) {
+    memcpy(dest, r->data + r->pos, n);
+    r->pos += n;
+}
+
+uint16_t get_u16(reader_t* r) {
+    uint16_t v;
+    get_bytes(r, &v, sizeof(v));
+    return ntohs(v);
+}
+
+uint32_t get_u32(reader_t* r) {
+    uint32_t v;
+    get_bytes(r, &v, sizeof(v));
+    return ntohl(v);
+}
+
+// Varints
+size_t varint_size(uint32_t v) {
+
+    size_t n = 1;
+    while (v >= 0x80) {
+        v >>= 7;
+        n++;
+    }
+
+    return n;
+}
+
+int write_varint(buffer_t* b, uint32_t v) {
+
+    if (buffer_reserve(b, varint_size(v)))
+        return 1;
+
+    put_varint(b, v);
+    return 0;
+}
+
+void put_varint(buffer_t* b, uint32_t v) {
+
+    while (v >= 0x80) {
+        b->data[b->size++] = (uint8_t) (v | 0x80);
+        v >>= 7;
+    }
+
+    b->data[b->size++] = (uint8_t) v;
+}
+
+int read_varint(reader_t* r, uint32_t* out) {
+
+    uint32_t v = 0;
+    for (int i = 0; i < MAX_VARINT_SIZE; i++) {
+
+        if (r->pos >= r->size)
+            return 1;
+
+        uint8_t byte = r->data[r->pos++];
+        v |= (uint32_t) (byte & 0x7F) << (7 * i);
+
+        if (!(byte & 0x80)) {
+            *out = v;
+            return 0;
+        }
+    }
+
+    // Too many continuation bytes, not something we wrote
+    return 1;
+}
+
+// Bit writer
+void bit_writer_init(bit_writer_t* w, buffer_t* b) {
+    w->buffer = b;
+    w->acc = 0;
+    w->bits = 0;
+}
+
+int bit_write(bit_writer_t* w, uint32_t v, int nbits) {
+
+    w->acc |= (v & ((1u << nbits) - 1)) << w->bits;
+    w->bits += nbits;
+
+    while (w->bits >= 8) {
+        uint8_t byte = (uint8_t) w->acc;
+        if (write_bytes(w->buffer, &byte, 1))
+            return 1;
+
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+
+    return 0;
+}
+
+int bit_flush(bit_writer_t* w) {
+
+    if (w->bits == 0)
+        return 0;
+
+    // Pad the last byte with zeroes
+    return bit_write(w, 0, 8 - w->bits);
+}
+
+// Bit reader
+void bit_reader_init(bit_reader_t* br, reader_t* r) {
+    br->reader = r;
+    br->acc = 0;
+    br->bits = 0;
+}
+
+int bit_read(bit_reader_t* br, int nbits, uint32_t* out) {
+
+    while (br->bits < nbits) {
+        uint8_t byte;
+        if (read_bytes(br->reader, &byte, 1))
+            return 1;
+
+        br->acc |= (uint32_t) byte << br->bits;
+        br->bits += 8;
+    }
+
+    *out = br->acc & ((1u << nbits) - 1);
+    br->acc >>= nbits;
+    br->bits -= nbits;
+
     return 0;
 }
\ No newline at end of file
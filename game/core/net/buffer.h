@@ -22,12 +22,60 @@ typedef struct {
     size_t pos;
 } reader_t;
 
+// Checked writes, fail if the buffer is too small
 int write_bytes(buffer_t* b, const void* src, size_t n);
 void write_u16(buffer_t* b, uint16_t v);
 void write_u32(buffer_t* b, uint32_t v);
 
+// Checked reads, return non zero past the end of the data
 int read_u16(reader_t* r, uint16_t* out);
 int read_u32(reader_t* r, uint32_t* out);
 int read_bytes(reader_t* r, void* dest, size_t n);
 
+// Bounds are checked once up front with these, then the unchecked
+// put/get variants below can be used for the rest of the packet
+int buffer_reserve(buffer_t* b, size_t n);
+int reader_require(reader_t* r, size_t n);
+
+void put_bytes(buffer_t* b, const void* src, size_t n);
+void put_u16(buffer_t* b, uint16_t v);
+void put_u32(buffer_t* b, uint32_t v);
+
+void get_bytes(reader_t* r, void* dest, size_t n);
+uint16_t get_u16(reader_t* r);
+uint32_t get_u32(reader_t* r);
+
+// LEB128 varints, 7 bits per byte with the high bit set while more bytes follow
+// Small values (timestamps deltas, ids, counts) take a single byte
+#define MAX_VARINT_SIZE 5
+
+size_t varint_size(uint32_t v);
+int write_varint(buffer_t* b, uint32_t v);
+void put_varint(buffer_t* b, uint32_t v);
+int read_varint(reader_t* r, uint32_t* out);
+
+// Bit level packing, bits are filled from the least significant bit of each byte
+// Remember to flush the writer, the last byte is only written then
+typedef struct {
+    buffer_t* buffer;
+    uint32_t acc;
+    int bits;
+} bit_writer_t;
+
+typedef struct {
+    reader_t* reader;
+    uint32_t acc;
+    int bits;
+} bit_reader_t;
+
+void bit_writer_init(bit_writer_t* w, buffer_t* b);
+int bit_write(bit_writer_t* w, uint32_t v, int nbits); // nbits <= 24
+int bit_flush(bit_writer_t* w);
+
+void bit_reader_init(bit_reader_t* br, reader_t* r);
+int bit_read(bit_reader_t* br, int nbits, uint32_t* out); // nbits <= 24
+
+// Bytes taken by n bits once flushed
+#define BITS_TO_BYTES(n) (((n) + 7) / 8)
+
 #endif
\ No newline at end of file
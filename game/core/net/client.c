@@ -3,27 +3,31 @@
  * @brief       UDP client to communicate with game server
  */
 #include "client.h"
+#include "../utils.h"
+#include "../log.h"
+#include "prediction.h"
+#include "rollback.h"
+#include "spectate.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
 
-buffer_t global_buffer = {
-    .data = NULL,
-    .size = 0,
-    .capacity = MAX_PACKET_SIZE,
-};
+// Every thread serializes into its own buffer, so boards, bots or anything else can send
+// at the same time without locking. A plain array, so there's nothing to set up per thread
+static _Thread_local uint8_t send_data[MAX_PACKET_SIZE];
 
 int client_init(udp_client* client, const char* host, int port){
 
     client->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (client->sockfd < 0) {
-        fprintf(stderr, "Failed to create UDP socket");
+        LOG_ERROR("Failed to create UDP socket: %s", strerror(errno));
         return -1;
     }
 
@@ -34,28 +38,104 @@ int client_init(udp_client* client, const char* host, int port){
 
     // Connect
     if (connect(client->sockfd, (struct sockaddr*) &client->server_addr, sizeof(client->server_addr)) < 0) {
-        fprintf(stderr, "Failed to connect to UDP socket");
+        LOG_ERROR("Failed to connect to UDP socket: %s", strerror(errno));
         return -1;
     }
 
+    client->next_player_id = 0;
+    memset(client->boards, 0, sizeof(client->boards));
+    reliable_init(&client->channel);
+    clock_sync_init(&client->clock);
+    client->session = NULL;
+    client->versus = VERSUS_NONE;
+    client->versus_seed = 0;
+    client->spectate = NULL;
+    atomic_init(&client->packets_sent, 0);
+    client->packets_received = 0;
+
     // Make socket non-blocking
     fcntl(client->sockfd, F_SETFL, O_NONBLOCK);
 
-    // Fill global buffer
-    global_buffer.data = malloc(MAX_PACKET_SIZE);
-    assert(global_buffer.data);
-
     return 0;
 }
 
-// ts better never be called before init or I'm FINISHED
 int client_send(udp_client* client, packet_types_t* p)
 {
-    // reset buffer and serialize
-    global_buffer.size = 0;
-    serialize_packet(&global_buffer, p);
-    
-    return send(client->sockfd, global_buffer.data, global_buffer.size, 0);
+    buffer_t buffer = {
+        .data = send_data,
+        .capacity = sizeof(send_data),
+        .size = 0,
+    };
+
+    if (serialize_packet(&buffer, p))
+        return -1;
+
+    atomic_fetch_add_explicit(&client->packets_sent, 1, memory_order_relaxed);
+    return send(client->sockfd, buffer.data, buffer.size, 0);
+}
+
+static int send_reliable_message(udp_client* client, const reliable_message_t* m)
+{
+    return client_send(client, &(packet_types_t) {
+        .type = PACKET_TYPE_RELIABLE,
+        .reliable = {
+            .seq = m->seq,
+            .payload = { .data = m->data, .size = m->size },
+        },
+    });
+}
+
+int client_send_reliable(udp_client* client, packet_types_t* p)
+{
+    uint8_t data[RELIABLE_MAX_MESSAGE];
+    buffer_t message = {
+        .data = data,
+        .capacity = sizeof(data),
+        .size = 0,
+    };
+
+    if (serialize_packet(&message, p))
+        return -1;
+
+    const reliable_message_t* m = reliable_queue(&client->channel, message.data, message.size, now_ms());
+    if (!m) {
+        LOG_WARN("Reliable channel is full, dropping packet %d", p->type);
+        return -1;
+    }
+
+    return send_reliable_message(client, m);
+}
+
+static int send_spectate_ack(udp_client* client)
+{
+    client->spectate->last_request = now_ms();
+    return client_send(client, &(packet_types_t) {
+        .type = PACKET_TYPE_SPECTATE,
+        .spectate = { .ack = client->spectate->frame },
+    });
+}
+
+int client_spectate(udp_client* client, spectate_client_t* spectate)
+{
+    client->spectate = spectate;
+    return spectate ? send_spectate_ack(client) : 0;
+}
+
+int client_versus_join(udp_client* client)
+{
+    client->versus = VERSUS_WAITING;
+    return client_send_reliable(client, &(packet_types_t) { .type = PACKET_TYPE_VERSUS_JOIN });
+}
+
+int client_versus_leave(udp_client* client)
+{
+    if (client->versus == VERSUS_NONE)
+        return 0;
+
+    // Nothing to tell if they're the ones who left
+    char over = client->versus == VERSUS_OVER;
+    client->versus = VERSUS_NONE;
+    return over ? 0 : client_send_reliable(client, &(packet_types_t) { .type = PACKET_TYPE_VERSUS_LEAVE });
 }
 
 int client_receive(udp_client* client, void* buffer, int buffer_size)
@@ -63,6 +143,154 @@ int client_receive(udp_client* client, void* buffer, int buffer_size)
     return recv(client->sockfd, buffer, buffer_size, 0);
 }
 
+static void handle_game_state(udp_client* client, game_state_t* state) {
+
+    reliable_on_ack(&client->channel, (uint16_t) state->ack, state->ack_bits);
+
+    if (state->player >= MAX_CLIENT_PLAYERS || !client->boards[state->player])
+        return;
+
+    tetris_board* game = client->boards[state->player];
+
+    // Never past what was sent
+    if ((int32_t) (game->net.next_seq - state->seq) < 0)
+        return;
+
+    // States can arrive out of order, only ever move forward
+    if ((int32_t) (state->seq - game->net.acked_seq) < 0)
+        return;
+
+    game->net.acked_seq = state->seq;
+    prediction_reconcile(game, state->seq, &state->state);
+}
+
+static void handle_packet(udp_client* client, packet_types_t* packet, arena_t* arena) {
+
+    switch (packet->type) {
+        case PACKET_TYPE_GAME_STATE:
+            handle_game_state(client, &packet->game_state);
+            break;
+        case PACKET_TYPE_ACK:
+            reliable_on_ack(&client->channel, (uint16_t) packet->ack.ack, packet->ack.ack_bits);
+            break;
+        case PACKET_TYPE_PING: {
+            uint32_t now = now_ms();
+            packet_types_t pong = { .type = PACKET_TYPE_PONG };
+            clock_sync_pong(&packet->ping, &pong.pong, now, now);
+            client_send(client, &pong);
+            break;
+        }
+        case PACKET_TYPE_PONG:
+            clock_sync_on_pong(&client->clock, &packet->pong, now_ms());
+            client->channel.resend_ms = clock_sync_rto(&client->clock, RELIABLE_RESEND_MS);
+            break;
+        case PACKET_TYPE_SPECTATE_FRAME:
+            if (!client->spectate)
+                break;
+
+            // Ack what we have either way, so the next one comes against something we can use
+            spectate_client_on_frame(client->spectate, &packet->spectate_frame);
+            send_spectate_ack(client);
+            break;
+        case PACKET_TYPE_VERSUS_START:
+            if (client->versus != VERSUS_WAITING)
+                break;
+
+            client->versus_seed = packet->versus_start.seed;
+            client->versus = VERSUS_PLAYING;
+            break;
+        case PACKET_TYPE_VERSUS_LEAVE:
+            if (client->versus == VERSUS_PLAYING)
+                client->versus = VERSUS_OVER;
+            break;
+        case PACKET_TYPE_ROLLBACK_INPUT:
+            if (client->session)
+                rollback_on_input(client->session, &packet->rollback_input);
+            break;
+        case PACKET_TYPE_REJECT: {
+            uint8_t id = packet->reject.player;
+            if (id >= MAX_CLIENT_PLAYERS || !client->boards[id])
+                break;
+
+            // No room on the server, the board keeps going offline
+            // Unbound quietly, a disconnect would only make the server a new peer to forget
+            LOG_WARN("Server rejected player %d, playing offline", id);
+            client->boards[id]->server = NULL;
+            client->boards[id] = NULL;
+            break;
+        }
+        case PACKET_TYPE_RELIABLE: {
+            reliable_t* r = &packet->reliable;
+            reliable_on_receive(&client->channel, (uint16_t) r->seq, r->payload.data, r->payload.size);
+
+            packet_types_t ack = { .type = PACKET_TYPE_ACK };
+            reliable_ack_header(&client->channel, &ack.ack.ack, &ack.ack.ack_bits);
+            client_send(client, &ack);
+
+            const reliable_message_t* m;
+            while ((m = reliable_deliver(&client->channel))) {
+
+                reader_t reader = {
+                    .data = (uint8_t*) m->data,
+                    .size = m->size,
+                    .pos = 0
+                };
+
+                packet_types_t inner;
+                if (deserialize_packet(&reader, &inner, arena) || inner.type == PACKET_TYPE_RELIABLE)
+                    continue;
+
+                handle_packet(client, &inner, arena);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void client_poll(udp_client* client)
+{
+    uint8_t buffer[MAX_PACKET_SIZE];
+    uint8_t scratch[MAX_PACKET_SIZE];
+    arena_t arena;
+
+    int len;
+    while ((len = client_receive(client, buffer, sizeof(buffer))) > 0) {
+
+        client->packets_received++;
+
+        arena_init(&arena, scratch, sizeof(scratch));
+        reader_t reader = {
+            .data = buffer,
+            .size = len,
+            .pos = 0
+        };
+
+        packet_types_t packet;
+        if (deserialize_packet(&reader, &packet, &arena))
+            continue;
+
+        handle_packet(client, &packet, &arena);
+    }
+
+    uint32_t now = now_ms();
+
+    // Resend whatever the server didn't ack in time
+    int cursor = 0;
+    const reliable_message_t* m;
+    while ((m = reliable_next_resend(&client->channel, now, &cursor)))
+        send_reliable_message(client, m);
+
+    packet_types_t ping = { .type = PACKET_TYPE_PING };
+    if (clock_sync_ping(&client->clock, &ping.ping, now))
+        client_send(client, &ping);
+
+    // Nothing's moving, let the server know we're still watching
+    if (client->spectate && now - client->spectate->last_request >= SPECTATE_REQUEST_MS)
+        send_spectate_ack(client);
+}
+
 void client_destroy(udp_client* client)
 {
     close(client->sockfd);
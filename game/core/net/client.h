@@ -6,27 +6,76 @@
 #define CLIENT_H
 
 #include <netinet/in.h>
+#include <stdatomic.h>
 
 #include "packets.h"
 #include "buffer.h"
+#include "reliable.h"
+#include "clock_sync.h"
 
-// I was gonna make this __thread but it made the game crash
-extern buffer_t global_buffer;
+#define MAX_CLIENT_PLAYERS 4
+
+// Online versus, the server pairs us with someone and hands both of us the seed
+typedef enum {
+    VERSUS_NONE,
+    VERSUS_WAITING, // Joined, nobody to play yet
+    VERSUS_PLAYING, // Paired, start the session with versus_seed
+    VERSUS_OVER, // The opponent left or timed out
+} versus_state;
 
 typedef struct udp_client {
     int sockfd;
     struct sockaddr_in server_addr;
+
+    // Several boards can share a socket, each one gets its own id
+    uint8_t next_player_id;
+    struct tetris_board* boards[MAX_CLIENT_PLAYERS];
+
+    // Control messages to and from the server
+    reliable_channel_t channel;
+
+    // Round trip and clock offset to the server, refreshed from client_poll
+    clock_sync_t clock;
+
+    // Versus session fed by the opponent's relayed inputs, if any
+    struct rollback_session* session;
+    versus_state versus; // Written from client_poll
+    uint32_t versus_seed;
+
+    // Match being watched, if any
+    struct spectate_client* spectate;
+
+    // Stats
+    _Atomic unsigned int packets_sent; // Sends come from any thread
+    unsigned int packets_received; // Only client_poll receives
 } udp_client;
 
 // Initialize client and connect to server
 int client_init(udp_client* client, const char* ip, int port);
 
-// Send raw data
+// Send raw data, safe to call from any thread
+// The reliable channel isn't, client_send_reliable and client_poll stay on one thread
 int client_send(udp_client* client, packet_types_t* data);
 
+// Send a packet that has to arrive, it is resent from client_poll until acked
+int client_send_reliable(udp_client* client, packet_types_t* data);
+
+// Start watching the server's match, frames get decoded into `spectate` from client_poll
+int client_spectate(udp_client* client, struct spectate_client* spectate);
+
+// Ask the server for a versus match, client_poll moves `versus` along from there
+int client_versus_join(udp_client* client);
+
+// Out of the queue or the match, the opponent is told
+int client_versus_leave(udp_client* client);
+
 // Receive data (non-blocking)
 int client_receive(udp_client* client, void* buffer, int buffer_size);
 
+// Drain every pending packet from the server and apply it to the bound boards
+// Also resends reliable messages that timed out and pings the server, so call it every frame
+void client_poll(udp_client* client);
+
 // Cleanup
 void client_destroy(udp_client* client);
 
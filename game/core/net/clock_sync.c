@@ -0,0 +1,90 @@
+/**
+ * @file        clock_sync.c
+ * @brief       Round trip and clock offset estimation
+ */
+
+#include "clock_sync.h"
+
+#include <string.h>
+
+#define RTT_GAIN 0.125f // 1/8, same as TCP
+#define JITTER_GAIN 0.25f // 1/4
+
+#define MIN_RTO_MS 20
+#define MAX_RTO_MS 1000
+
+void clock_sync_init(clock_sync_t* cs) {
+    memset(cs, 0, sizeof(*cs));
+}
+
+int clock_sync_ping(clock_sync_t* cs, ping_t* out, uint32_t now) {
+
+    if (cs->has_pinged && now - cs->last_ping_time < CLOCK_SYNC_INTERVAL_MS)
+        return 0;
+
+    cs->has_pinged = 1;
+    cs->last_ping_time = now;
+
+    out->id = cs->next_ping_id++;
+    out->time = now;
+    return 1;
+}
+
+void clock_sync_pong(const ping_t* ping, pong_t* out, uint32_t received, uint32_t now) {
+    out->id = ping->id;
+    out->ping_time = ping->time;
+    out->received_time = received;
+    out->sent_time = now;
+}
+
+void clock_sync_on_pong(clock_sync_t* cs, const pong_t* pong, uint32_t now) {
+
+    // Clocks wrap, differences don't care
+    int32_t total = (int32_t) (now - pong->ping_time);
+    int32_t held = (int32_t) (pong->sent_time - pong->received_time);
+
+    // Not an answer to anything we sent, or they took longer to answer than we waited
+    if (total < 0 || held < 0 || held > total)
+        return;
+
+    clock_sample_t sample = {
+        .rtt = (uint32_t) (total - held),
+        .offset = ((int32_t) (pong->received_time - pong->ping_time) + (int32_t) (pong->sent_time - now)) / 2,
+    };
+
+    cs->window[cs->samples % CLOCK_SYNC_WINDOW] = sample;
+    cs->samples++;
+
+    if (cs->samples == 1) {
+        cs->rtt = (float) sample.rtt;
+        cs->jitter = (float) sample.rtt / 2;
+    } else {
+        float deviation = cs->rtt - (float) sample.rtt;
+        if (deviation < 0) deviation = -deviation;
+
+        cs->jitter += JITTER_GAIN * (deviation - cs->jitter);
+        cs->rtt += RTT_GAIN * ((float) sample.rtt - cs->rtt);
+    }
+
+    // Min filter, the fastest recent trip has the most trustworthy offset
+    unsigned int count = cs->samples < CLOCK_SYNC_WINDOW ? cs->samples : CLOCK_SYNC_WINDOW;
+    const clock_sample_t* best = &cs->window[0];
+    for (unsigned int i = 1; i < count; i++)
+        if (cs->window[i].rtt < best->rtt)
+            best = &cs->window[i];
+
+    cs->min_rtt = best->rtt;
+    cs->offset = best->offset;
+}
+
+uint32_t clock_sync_rto(const clock_sync_t* cs, uint32_t fallback) {
+
+    if (!cs->samples)
+        return fallback;
+
+    uint32_t rto = (uint32_t) (cs->rtt + 4 * cs->jitter);
+    if (rto < MIN_RTO_MS) rto = MIN_RTO_MS;
+    if (rto > MAX_RTO_MS) rto = MAX_RTO_MS;
+
+    return rto;
+}
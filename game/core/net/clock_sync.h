@@ -0,0 +1,63 @@
+/**
+ * @file        clock_sync.h
+ * @brief       Round trip and clock offset estimation
+ */
+
+#ifndef CLOCK_SYNC_H
+#define CLOCK_SYNC_H
+
+#include "packets.h"
+
+#include <stdint.h>
+
+/**
+ * NTP style, every so often we send a PING with our clock, the other side answers
+ * with a PONG holding that plus when it got the ping and when it answered. That's
+ * four timestamps (t0 sent, t1 received, t2 answered, t3 back) which give
+ *
+ *   rtt    = (t3 - t0) - (t2 - t1)
+ *   offset = ((t1 - t0) + (t2 - t3)) / 2    (their clock - ours)
+ *
+ * The smoothed rtt and jitter are EWMAs like TCP's srtt/rttvar. Queuing only ever
+ * makes a trip longer, so the offset comes from the fastest trip of the last few
+ * (the NTP clock filter), that one had the least delay to be asymmetric about.
+ */
+#define CLOCK_SYNC_INTERVAL_MS 250
+#define CLOCK_SYNC_WINDOW 8 // Samples the min filter looks at
+
+typedef struct {
+    uint32_t rtt;
+    int32_t offset;
+} clock_sample_t;
+
+typedef struct {
+
+    uint32_t next_ping_id;
+    uint32_t last_ping_time;
+    char has_pinged;
+
+    clock_sample_t window[CLOCK_SYNC_WINDOW];
+    unsigned int samples; // Total ever taken
+
+    // Stats, in ms
+    float rtt; // Smoothed
+    float jitter; // Mean deviation of the rtt
+    uint32_t min_rtt; // Fastest trip in the window
+    int32_t offset; // Their clock - ours, taken from the fastest trip
+} clock_sync_t;
+
+void clock_sync_init(clock_sync_t* cs);
+
+// Fill a ping if it's time for one, returns 0 if there's nothing to send
+int clock_sync_ping(clock_sync_t* cs, ping_t* out, uint32_t now);
+
+// Answer a ping, `received` is when it got here
+void clock_sync_pong(const ping_t* ping, pong_t* out, uint32_t received, uint32_t now);
+
+// Take a sample out of an answer to one of our pings
+void clock_sync_on_pong(clock_sync_t* cs, const pong_t* pong, uint32_t now);
+
+// Retransmit timeout worth using with the current estimate, TCP style srtt + 4 * rttvar
+uint32_t clock_sync_rto(const clock_sync_t* cs, uint32_t fallback);
+
+#endif
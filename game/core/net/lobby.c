@@ -3,13 +3,19 @@
  * @brief       Game lobby, represents the state of a multiplayer game
  */
 #include "lobby.h"
+#include "../replay_archive.h"
+
+#include <stdio.h>
 #include <string.h>
 
-static int find_slot(lobby_t* lobby, const char* player) {
-    for (int i = 0; i < 2; i++)
-        if (lobby->players[i].game.name &&
-            strcmp(lobby->players[i].game.name, player) == 0)
+static int find_slot(lobby_t* lobby, const struct sockaddr_in* addr, uint8_t id) {
+    for (int i = 0; i < 2; i++) {
+        lobby_player_t* p = &lobby->players[i];
+        if (p->game.name && p->id == id &&
+            p->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            p->addr.sin_port == addr->sin_port)
             return i;
+    }
     
     return -1;
 }
@@ -22,35 +28,169 @@ static int empty_slot(lobby_t* lobby) {
     return -1;
 }
 
-int spawn_player(lobby_t* lobby, const char* player, unsigned int seed) {
+// Where a slot's match is recorded while it's being played
+static void match_path(char* path, size_t size, const lobby_t* lobby, int slot) {
+    snprintf(path, size, "match_%d_%d.ntr", lobby->id, slot);
+}
+
+int spawn_player(lobby_t* lobby, const char* player, const struct sockaddr_in* addr, uint8_t id, unsigned int seed) {
     int slot = empty_slot(lobby);
     if (slot < 0) return 1;
 
     lobby_player_t* p = &lobby->players[slot];
     
-    tetris_init(&p->game, ROWS, COLS, seed, strdup(player));
-    p->last_move_time = 0;
-    p->last_drop_time = 0;
+    replay_settings settings = {
+        .seed = seed,
+        .rows = ROWS,
+        .cols = COLS,
+        .preview_count = 3,
+    };
+    replay_setup_board(&p->game, &settings, strdup(player));
+    p->addr = *addr;
+    p->id = id;
+    p->next_seq = 0;
+    p->clock_offset = 0;
+    p->clock_time = 0;
+    p->has_clock = 0;
+    p->last_client_time = 0;
+    p->last_input_time = 0;
+
+    memset(p->hashes, 0, sizeof(p->hashes));
+    p->desynced = 0;
+    lobby_record_hash(p, 0, 0);
+
+    char path[32];
+    match_path(path, sizeof(path), lobby, slot);
+    if (!replay_record_start(&p->recorder, path, &settings, 0))
+        p->game.recorder = &p->recorder;
 
     return 0;
 }
 
-lobby_player_t* get_player(lobby_t* lobby, const char* player) {
+lobby_player_t* get_player(lobby_t* lobby, const struct sockaddr_in* addr, uint8_t id) {
 
-    int slot = find_slot(lobby, player);
+    int slot = find_slot(lobby, addr, id);
     return slot >= 0 ? &lobby->players[slot] : NULL;
 }
 
-void remove_player(lobby_t* lobby, const char* player) {
+void remove_player(lobby_t* lobby, const struct sockaddr_in* addr, uint8_t id) {
     
-    int slot = find_slot(lobby, player);
+    int slot = find_slot(lobby, addr, id);
     if (slot < 0) return;
+
+    lobby_player_t* p = &lobby->players[slot];
+    if (p->game.recorder) {
+        uint64_t hash = tetris_state_hash(&p->game);
+        replay_record_finish(&p->recorder);
+
+        char path[32];
+        match_path(path, sizeof(path), lobby, slot);
+        replay_archive_append_file(MATCH_ARCHIVE_PATH, path, hash);
+        remove(path);
+    }
     
-    tetris_destroy(&lobby->players[slot].game);
+    tetris_destroy(&p->game);
     memset(&lobby->players[slot], 0, sizeof(lobby_player_t));
 }
 
 int lobby_full(lobby_t* lobby) {
     
     return empty_slot(lobby) < 0;
+}
+
+int lobby_empty(lobby_t* lobby) {
+
+    for (int i = 0; i < 2; i++)
+        if (lobby->players[i].game.name)
+            return 0;
+
+    return 1;
+}
+
+uint8_t lobby_accept_inputs(lobby_player_t* p, uint8_t* actions, uint32_t* times, uint8_t count, uint32_t now) {
+
+    for (uint8_t i = 0; i < count; i++) {
+
+        int64_t offset = (int64_t) now - times[i];
+        if (!p->has_clock) {
+            p->clock_offset = offset;
+            p->clock_time = now;
+            p->has_clock = 1;
+            continue;
+        }
+
+        if (offset >= p->clock_offset)
+            continue;
+
+        // Faster trip than ever, or their clock running ahead, only trust so much of it
+        int64_t lowest = p->clock_offset - (int64_t) (now - p->clock_time) * INPUT_CLOCK_DRIFT_MS / 1000;
+        p->clock_offset = offset > lowest ? offset : lowest;
+        p->clock_time = now;
+    }
+
+    // Cooldowns are checked on the spacing they made the inputs with, the same the client checked
+    for (uint8_t i = 0; i < count; i++) {
+        if (times[i] < p->last_client_time)
+            times[i] = p->last_client_time;
+        p->last_client_time = times[i];
+    }
+
+    uint8_t kept = validate_input_batch(&p->game.validator, actions, times, count);
+    if (!kept)
+        return 0;
+
+    // Where their clock should be right now, give or take the trip here
+    // The whole batch moves by one correction so the gaps between inputs survive, it only
+    // bounds how far ahead or behind their clock may be
+    int64_t expected = (int64_t) now - p->clock_offset;
+    int64_t oldest = times[0];
+    int64_t newest = times[kept - 1];
+
+    int64_t shift = 0;
+    if (oldest + shift < p->last_input_time) shift = p->last_input_time - oldest;
+    if (oldest + shift < expected - INPUT_MAX_AGE_MS) shift = expected - INPUT_MAX_AGE_MS - oldest;
+    if (newest + shift > expected + INPUT_CLOCK_SLACK_MS) shift = expected + INPUT_CLOCK_SLACK_MS - newest;
+
+    for (uint8_t i = 0; i < kept; i++) {
+
+        // Only a batch pulled back past the last one ever gets squeezed
+        int64_t t = times[i] + shift;
+        if (t < p->last_input_time) t = p->last_input_time;
+
+        times[i] = (uint32_t) t;
+        p->last_input_time = times[i];
+    }
+
+    return kept;
+}
+
+void lobby_record_hash(lobby_player_t* p, uint32_t seq, uint32_t time) {
+
+    p->hashes[seq & (INPUT_HISTORY_SIZE - 1)] = (lobby_hash_t) {
+        .seq = seq,
+        .time = time,
+        .hash = tetris_state_hash(&p->game),
+    };
+}
+
+int lobby_check_hash(lobby_player_t* p, uint32_t seq, uint64_t hash, uint64_t* ours, uint32_t* time) {
+
+    // Batches don't always end in the same place on both sides, only compare when they do
+    const lobby_hash_t* h = &p->hashes[seq & (INPUT_HISTORY_SIZE - 1)];
+    if (h->seq != seq)
+        return 0;
+
+    if (h->hash == hash) {
+        p->desynced = 0;
+        return 0;
+    }
+
+    *ours = h->hash;
+    *time = h->time;
+
+    if (p->desynced)
+        return 0;
+
+    p->desynced = 1;
+    return 1;
 }
\ No newline at end of file
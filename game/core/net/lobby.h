@@ -7,24 +7,77 @@
 #define LOBBY_H
 
 #include "../tetris.h"
+#include "../replay.h"
 
 #include <netinet/in.h>
 #include <stdint.h>
 
+// Our board's hash once a player's inputs bellow seq were applied
+typedef struct {
+    uint32_t seq;
+    uint32_t time; // Their time of input seq - 1
+    uint64_t hash;
+} lobby_hash_t;
+
 typedef struct {
     tetris_board game;
+
+    // Players are identified by the socket they play from and their id on it
     struct sockaddr_in addr;
-    uint32_t last_move_time;
-    uint32_t last_drop_time;
+    uint8_t id;
+
+    uint32_t next_seq; // Next input sequence we expect, anything bellow is a resend
+
+    // Inputs are validated on the player's own clock, the times they send along
+    // We keep an estimate of how it maps to ours so it can't run ahead or fall behind
+    int64_t clock_offset; // Smallest ours - theirs seen, the input that got here fastest
+    uint32_t clock_time; // When the offset last went down
+    char has_clock;
+    uint32_t last_client_time; // Their own times never go backwards, rate limits run on these
+    uint32_t last_input_time; // Same for the times we apply them at
+
+    // Our board's hash after their inputs, by sequence, to check the ones they send against
+    // Only batch ends get one, that's where both sides hash, see send_input_t
+    lobby_hash_t hashes[INPUT_HISTORY_SIZE];
+    char desynced; // Hashes stopped matching and haven't matched since
+
+    // Every match is recorded, and archived once the player leaves
+    replay_recorder recorder;
 } lobby_player_t;
 
+// Where finished matches end up, replay_verify checks them
+#define MATCH_ARCHIVE_PATH "matches.nta"
+
+// How far a player's input times may drift from what we estimate their clock to be
+#define INPUT_CLOCK_SLACK_MS 50
+#define INPUT_MAX_AGE_MS 1000
+
+// How fast their clock may run ahead of ours, in ms per second, so faking times to dodge
+// cooldowns buys next to nothing while a slow first packet still gets corrected quickly
+#define INPUT_CLOCK_DRIFT_MS 50
+
 typedef struct {
+    int id; // Tells apart the recordings of matches being played at the same time
     lobby_player_t players[2];
 } lobby_t;
 
-int spawn_player (lobby_t* lobby, const char* player, unsigned int seed);
-lobby_player_t* get_player (lobby_t* lobby, const char* player);
-void remove_player (lobby_t* lobby, const char* player);
+int spawn_player (lobby_t* lobby, const char* player, const struct sockaddr_in* addr, uint8_t id, unsigned int seed);
+lobby_player_t* get_player (lobby_t* lobby, const struct sockaddr_in* addr, uint8_t id);
+void remove_player (lobby_t* lobby, const struct sockaddr_in* addr, uint8_t id);
 int lobby_full (lobby_t* lobby);
+int lobby_empty (lobby_t* lobby);
+
+// Check a run of new inputs from a player all at once, `now` is our clock when they arrived
+// Cooldowns are checked on the player's own times, then the batch is shifted as a whole into
+// the window we expect it in, so a late or early packet never changes the gaps between inputs
+// Rejected inputs are dropped, returns how many are left at the front of the arrays
+uint8_t lobby_accept_inputs (lobby_player_t* p, uint8_t* actions, uint32_t* times, uint8_t count, uint32_t now);
+
+// Keep our hash for when their inputs up to seq - 1 are applied, `time` is when they made the last one
+void lobby_record_hash (lobby_player_t* p, uint32_t seq, uint32_t time);
+
+// Check the hash they sent for seq against ours, returns 1 only on the first mismatch after
+// being in sync, with our hash and their input time there, 0 if it matches or we don't have it
+int lobby_check_hash (lobby_player_t* p, uint32_t seq, uint64_t hash, uint64_t* ours, uint32_t* time);
 
 #endif
\ No newline at end of file
@@ -6,34 +6,194 @@
 #define PACKET_PAYLOADS_H
 
 #include <time.h>
+#include <stdint.h>
+
+/**
+ * A batch of inputs from a single player
+ * Inputs are numbered, the batch holds first_seq, first_seq + 1, ... so the server can drop
+ * the ones it already got, since clients resend everything that wasn't acked yet
+ * Gravity comes a row at a time, back to back rows share an entry that takes `rows` numbers
+ * Times are milliseconds since the player's session started, so they stay small
+ * On the wire: varint first seq, varint first time, 4 bit count and 4 bit opcodes, gravity followed
+ * by 4 bits of rows - 1, then varint time deltas
+ */
+#define MAX_BATCH_INPUTS 15
+#define MAX_GRAVITY_RUN 16
+#define INPUT_OPCODE_BITS 4
+
+typedef struct input_batch {
+    uint32_t first_seq;
+    uint8_t count;
+    uint8_t action[MAX_BATCH_INPUTS];
+    uint8_t rows[MAX_BATCH_INPUTS]; // Inputs this entry stands for, only gravity has more than one
+    uint32_t time[MAX_BATCH_INPUTS];
+} input_batch_t;
+
+/**
+ * Per tick inputs for rollback, one bitmask of input_event_type per tick starting at first_tick
+ * On the wire: varint first tick, count, then a bit per tick saying if anything was pressed
+ * followed by the pressed bits. Most ticks nobody presses anything so they cost a single bit
+ * Gravity comes from the tick itself and never goes out, so a mask is the other 8 events
+ */
+#define MAX_RUN_INPUTS 16
+#define RUN_MASK_BITS 8
+
+typedef struct input_run {
+    uint32_t first_tick;
+    uint8_t count;
+    uint16_t mask[MAX_RUN_INPUTS];
+} input_run_t;
+
+/**
+ * Raw bytes, on decode this points straight into the receive buffer
+ * so it is only valid as long as that buffer is
+ */
+typedef struct bytes {
+    const uint8_t* data;
+    uint16_t size;
+} bytes_t;
 
 // Packet payloads
 typedef struct connect {
 #define CONNECT_FIELDS(_F, ...)     \
+    _F(player, __VA_ARGS__)         \
     _F(username, __VA_ARGS__)       \
     _F(connect_time, __VA_ARGS__)
+    uint8_t player; // Id of the board on the sending socket, used instead of the username from now on
     const char* username;
     time_t connect_time;
 } connect_t;
 
 typedef struct disconnect {
 #define DISCONNECT_FIELDS(_F, ...)  \
-    _F(username, __VA_ARGS__)       \
+    _F(player, __VA_ARGS__)         \
     _F(disconnect_time, __VA_ARGS__)
-    const char* username;
+    uint8_t player;
     time_t disconnect_time; 
 } disconnect_t;
 
 typedef struct send_input {
 #define SEND_INPUT_FIELDS(_F, ...)  \
-    _F(username, __VA_ARGS__)       \
-    _F(input_time, __VA_ARGS__)     \
-    _F(input, __VA_ARGS__)          
-    const char* username;
-    time_t input_time; 
-    input_event_type input; 
+    _F(player, __VA_ARGS__)         \
+    _F(inputs, __VA_ARGS__)         \
+    _F(hash_seq, __VA_ARGS__)       \
+    _F(hash, __VA_ARGS__)
+    uint8_t player;
+    input_batch_t inputs;
+
+    // Where the sender's board is at, tetris_state_hash right after applying input hash_seq - 1
+    // The server compares it to its own to catch desyncs without anyone sending a whole board
+    uint32_t hash_seq;
+    uint64_t hash;
 } send_input_t;
 
+// Authoritative state of a player's board, sent back after applying their inputs
+typedef struct game_state {
+#define GAME_STATE_FIELDS(_F, ...)  \
+    _F(player, __VA_ARGS__)         \
+    _F(seq, __VA_ARGS__)            \
+    _F(state, __VA_ARGS__)          \
+    _F(ack, __VA_ARGS__)            \
+    _F(ack_bits, __VA_ARGS__)
+    uint8_t player;
+    uint32_t seq; // The server got and applied every input bellow this one
+    tetris_snapshot state; // The board right after input seq - 1
+
+    // Reliable channel acks ride along for free
+    uint32_t ack;
+    uint32_t ack_bits;
+} game_state_t;
+
+// A control message that has to arrive, the payload is a whole serialized packet
+typedef struct reliable {
+#define RELIABLE_FIELDS(_F, ...)    \
+    _F(seq, __VA_ARGS__)            \
+    _F(payload, __VA_ARGS__)
+    uint32_t seq;
+    bytes_t payload;
+} reliable_t;
+
+// Standalone reliable channel ack, for when there's nothing to piggyback on
+typedef struct ack {
+#define ACK_FIELDS(_F, ...)         \
+    _F(ack, __VA_ARGS__)            \
+    _F(ack_bits, __VA_ARGS__)
+    uint32_t ack;
+    uint32_t ack_bits;
+} ack_t;
+
+// Rollback inputs for the opponent, the server only relays these
+typedef struct rollback_input {
+#define ROLLBACK_INPUT_FIELDS(_F, ...)  \
+    _F(ack, __VA_ARGS__)                \
+    _F(inputs, __VA_ARGS__)
+    uint32_t ack; // Got every input of yours bellow this tick
+    input_run_t inputs;
+} rollback_input_t;
+
+// Clock sync, see clock_sync.h, times are the sender's now_ms()
+typedef struct ping {
+#define PING_FIELDS(_F, ...)        \
+    _F(id, __VA_ARGS__)             \
+    _F(time, __VA_ARGS__)
+    uint32_t id;
+    uint32_t time;
+} ping_t;
+
+typedef struct pong {
+#define PONG_FIELDS(_F, ...)        \
+    _F(id, __VA_ARGS__)             \
+    _F(ping_time, __VA_ARGS__)      \
+    _F(received_time, __VA_ARGS__)  \
+    _F(sent_time, __VA_ARGS__)
+    uint32_t id;
+    uint32_t ping_time; // Echoed back
+    uint32_t received_time; // When the ping got here, on our clock
+    uint32_t sent_time; // When this went out, on our clock
+} pong_t;
+
+// Ask to watch the match, then ack frames as they come, ack 0 means we have nothing
+typedef struct spectate {
+#define SPECTATE_FIELDS(_F, ...)    \
+    _F(ack, __VA_ARGS__)
+    uint32_t ack;
+} spectate_t;
+
+// Match state for spectators, delta encoded against a frame they acked (or nothing)
+typedef struct spectate_frame {
+#define SPECTATE_FRAME_FIELDS(_F, ...)  \
+    _F(frame, __VA_ARGS__)              \
+    _F(baseline, __VA_ARGS__)           \
+    _F(delta, __VA_ARGS__)
+    uint32_t frame;
+    uint32_t baseline; // 0 if this is the whole thing
+    bytes_t delta;
+} spectate_frame_t;
+
+// The server had no room for a player, the board goes on without it
+typedef struct reject {
+#define REJECT_FIELDS(_F, ...)      \
+    _F(player, __VA_ARGS__)
+    uint8_t player;
+} reject_t;
+
+// Versus matchmaking, the server pairs whoever asks and relays rollback inputs between them
+typedef struct versus_join {
+#define VERSUS_JOIN_FIELDS(_F, ...)
+} versus_join_t;
+
+// Paired, both sides start their session on tick 0 with this seed, boards and garbage alike
+typedef struct versus_start {
+#define VERSUS_START_FIELDS(_F, ...)    \
+    _F(seed, __VA_ARGS__)
+    uint32_t seed;
+} versus_start_t;
+
+// Done with the match, coming from the server it means the opponent left or timed out
+typedef struct versus_leave {
+#define VERSUS_LEAVE_FIELDS(_F, ...)
+} versus_leave_t;
+
 typedef struct none {
 #define NONE_FIELDS(_F, ...)
 } none_t; /* game struct as bytes */
@@ -6,123 +6,440 @@
 #include "packets.h"
 
 #include <stdio.h>
-#include <assert.h>
 #include <string.h>
-#include <stdlib.h>
 #include <netinet/in.h>
 
 type_desc_t types[] = {
     PACKET_TYPES_ITER(DO_TYPE_DESC)
 };
 
-void serialize_field(buffer_t* buffer, const field_desc_t* field, void* base) {
-
-    // Calculate pointer to field
-    void* field_ptr = (char*)base + field->offset;
-
-    // Whatever bro
-    uint32_t v;
-    float v2;
-    time_t v3;
-    const char* str;
-
-    switch (field->type)
-    {
-        case FIELD_TYPE_INT:
-            v = *(uint32_t*)field_ptr;
-            write_u32(buffer, v);
-            break;
-        case FIELD_TYPE_FLOAT:
-            v2 = *(float*)field_ptr;
-            write_bytes(buffer, &v2, sizeof(float));
-            break;
-        case FIELD_TYPE_STR:
-            str = *(const char**)field_ptr;
-            uint16_t len = (uint16_t) strlen(str);
-
-            write_u16(buffer, len);
-            write_bytes(buffer, str, len);
-            break;
-        case FIELD_TYPE_TIME:
-            v3 = *(time_t*)field_ptr;
-            write_bytes(buffer, &v3, sizeof(time_t)); // Consider making a write_u64
-            break;
-    }   
-}
-
-void serialize_packet(buffer_t* buffer, packet_types_t* packet) {
+// Board snapshots, cells and pieces are bit packed, the rng is raw and the counters are varints
+#define CELL_BITS 4
+#define PIECE_BITS (4 + 2 + 8 + 8)
+#define SNAPSHOT_BITS (CELL_BITS * ROWS * COLS + 3 * PIECE_BITS + 3 + 8 + 3 + 2)
+#define SNAPSHOT_COUNTERS 8
+#define SNAPSHOT_FIXED_SIZE (BITS_TO_BYTES(SNAPSHOT_BITS) + sizeof(uint32_t))
 
-    // Write packet type first
-    write_u16(buffer, (short) packet->type);
+// Per field type codecs, the packet codecs bellow are generated out of these
+// Sizes are the exact number of bytes the field takes on the wire
+static inline size_t size_int(const int* v)                 { (void) v; return sizeof(uint32_t); }
+static inline size_t size_u8(const uint8_t* v)              { (void) v; return sizeof(uint8_t); }
+static inline size_t size_varint_field(const uint32_t* v)   { return varint_size(*v); }
+static inline size_t size_u64(const uint64_t* v)            { (void) v; return sizeof(uint64_t); }
+static inline size_t size_float(const float* v)             { (void) v; return sizeof(float); }
+static inline size_t size_time(const time_t* v)             { (void) v; return 2 * sizeof(uint32_t); }
+static inline size_t size_str(const char* const* v)         { return sizeof(uint16_t) + strlen(*v); }
+static inline size_t size_bytes_field(const bytes_t* v)     { return sizeof(uint16_t) + v->size; }
+static inline size_t size_snapshot(const tetris_snapshot* v) {
+    return SNAPSHOT_FIXED_SIZE +
+        varint_size(v->points) + varint_size(v->level) + varint_size(v->level_goal) +
+        varint_size(v->stats.lines_cleared) + varint_size(v->stats.singles) +
+        varint_size(v->stats.doubles) + varint_size(v->stats.triples) + varint_size(v->stats.tetris);
+}
+static inline size_t size_batch(const input_batch_t* v) {
+
+    size_t nibbles = 1 + v->count;
+    for (uint8_t i = 0; i < v->count; i++)
+        if (v->action[i] == IE_GRAVITY) nibbles++;
+
+    size_t size = varint_size(v->first_seq) + BITS_TO_BYTES(INPUT_OPCODE_BITS * nibbles);
+    if (v->count == 0) return size + varint_size(0);
+
+    size += varint_size(v->time[0]);
+    for (uint8_t i = 1; i < v->count; i++)
+        size += varint_size(v->time[i] - v->time[i - 1]);
+
+    return size;
+}
+
+static inline size_t size_run(const input_run_t* v) {
+
+    size_t bits = v->count;
+    for (uint8_t i = 0; i < v->count; i++)
+        if (v->mask[i]) bits += RUN_MASK_BITS;
+
+    return varint_size(v->first_tick) + sizeof(uint8_t) + BITS_TO_BYTES(bits);
+}
+
+static inline void put_int(buffer_t* b, const int* v)                   { put_u32(b, (uint32_t) *v); }
+static inline void put_u8(buffer_t* b, const uint8_t* v)                { put_bytes(b, v, sizeof(uint8_t)); }
+static inline void put_varint_field(buffer_t* b, const uint32_t* v)     { put_varint(b, *v); }
+static inline void put_u64(buffer_t* b, const uint64_t* v)              { put_u32(b, (uint32_t) (*v >> 32)); put_u32(b, (uint32_t) *v); }
+static inline void put_float(buffer_t* b, const float* v)               { put_bytes(b, v, sizeof(float)); }
+static inline void put_time(buffer_t* b, const time_t* v) {
+    // time_t is 64 bits and host ordered, send it as two big endian halves
+    uint64_t t = (uint64_t) *v;
+    put_u32(b, (uint32_t) (t >> 32));
+    put_u32(b, (uint32_t) t);
+}
+static inline void put_str(buffer_t* b, const char* const* v) {
+    uint16_t len = (uint16_t) strlen(*v);
+    put_u16(b, len);
+    put_bytes(b, *v, len);
+}
+static inline void put_bytes_field(buffer_t* b, const bytes_t* v) {
+    put_u16(b, v->size);
+    put_bytes(b, v->data, v->size);
+}
+static inline void put_piece(bit_writer_t* w, const tetromino* t) {
+    bit_write(w, t->type, 4);
+    bit_write(w, t->rot, 2);
+    bit_write(w, (uint8_t) t->pos.x, 8);
+    bit_write(w, (uint8_t) t->pos.y, 8);
+}
+static inline void put_snapshot(buffer_t* b, const tetris_snapshot* v) {
+
+    bit_writer_t w;
+    bit_writer_init(&w, b);
+
+    for (size_t i = 0; i < ROWS * COLS; i++)
+        bit_write(&w, v->board[i], CELL_BITS);
+
+    put_piece(&w, &v->current);
+    put_piece(&w, &v->next);
+    put_piece(&w, &v->hold);
+
+    bit_write(&w, v->game_over, 1);
+    bit_write(&w, v->has_held, 1);
+    bit_write(&w, v->has_hold, 1);
+    bit_write(&w, (uint8_t) v->lock_grace_counter, 8);
+    bit_write(&w, v->rotations_tried, 3);
+    bit_write(&w, v->old_rot, 2);
+    bit_flush(&w);
+
+    put_u32(b, v->rng.seed);
+
+    put_varint(b, v->points);
+    put_varint(b, v->level);
+    put_varint(b, v->level_goal);
+    put_varint(b, v->stats.lines_cleared);
+    put_varint(b, v->stats.singles);
+    put_varint(b, v->stats.doubles);
+    put_varint(b, v->stats.triples);
+    put_varint(b, v->stats.tetris);
+}
+static inline void put_batch(buffer_t* b, const input_batch_t* v) {
+
+    put_varint(b, v->first_seq);
+
+    // Times are delta encoded, the first one is relative to the session start
+    put_varint(b, v->count ? v->time[0] : 0);
+
+    // Count and opcodes share nibbles, the whole batch fits in a few bytes
+    bit_writer_t w;
+    bit_writer_init(&w, b);
+    bit_write(&w, v->count, INPUT_OPCODE_BITS);
+    for (uint8_t i = 0; i < v->count; i++) {
+        bit_write(&w, v->action[i], INPUT_OPCODE_BITS);
+        if (v->action[i] == IE_GRAVITY)
+            bit_write(&w, v->rows[i] - 1u, INPUT_OPCODE_BITS);
+    }
+    bit_flush(&w);
 
-    const type_desc_t* desc = &types[packet->type];
-    void* payload = (void*) &packet->none;  
+    for (uint8_t i = 1; i < v->count; i++)
+        put_varint(b, v->time[i] - v->time[i - 1]);
+}
+
+static inline void put_run(buffer_t* b, const input_run_t* v) {
 
-    for (size_t i = 0; i < 16 /*Hard coded limit from struct*/ && desc->fields[i].name; i++)
-    {
-        serialize_field(buffer, &desc->fields[i], payload);
+    put_varint(b, v->first_tick);
+    put_bytes(b, &v->count, sizeof(uint8_t));
+
+    bit_writer_t w;
+    bit_writer_init(&w, b);
+    for (uint8_t i = 0; i < v->count; i++) {
+        bit_write(&w, v->mask[i] != 0, 1);
+        if (v->mask[i])
+            bit_write(&w, v->mask[i] >> 1, RUN_MASK_BITS);
     }
+    bit_flush(&w);
+}
+
+// Fixed size fields were already checked by the caller, only strings have to check their length
+static inline int get_int(reader_t* r, int* v, arena_t* a)                  { (void) a; *v = (int) get_u32(r); return 0; }
+static inline int get_u8(reader_t* r, uint8_t* v, arena_t* a)               { (void) a; get_bytes(r, v, sizeof(uint8_t)); return 0; }
+static inline int get_varint_field(reader_t* r, uint32_t* v, arena_t* a)    { (void) a; return read_varint(r, v); }
+static inline int get_u64(reader_t* r, uint64_t* v, arena_t* a)             { (void) a; *v = (uint64_t) get_u32(r) << 32; *v |= get_u32(r); return 0; }
+static inline int get_float(reader_t* r, float* v, arena_t* a)              { (void) a; get_bytes(r, v, sizeof(float)); return 0; }
+static inline int get_time(reader_t* r, time_t* v, arena_t* a) {
+    (void) a;
+    uint64_t hi = get_u32(r);
+    uint64_t lo = get_u32(r);
+    *v = (time_t) ((hi << 32) | lo);
+    return 0;
+}
+static inline int get_str(reader_t* r, const char** v, arena_t* a) {
+
+    // The length prefix is part of the fixed size block
+    uint16_t len = get_u16(r);
+    if (reader_require(r, len)) return 1;
+
+    // Strings are copied into the caller's arena instead of the heap, so they stay valid
+    // until the arena is reset and nobody has to remember to free them
+    char* str = (char*) arena_alloc(a, len + 1);
+    if (!str) return 1;
+
+    get_bytes(r, str, len);
+    str[len] = '\0';
+
+    *v = str;
+    return 0;
+}
+static inline int get_bytes_field(reader_t* r, bytes_t* v, arena_t* a) {
+    (void) a;
+
+    v->size = get_u16(r);
+    if (reader_require(r, v->size)) return 1;
+
+    // Borrow straight from the receive buffer, no copy
+    v->data = r->data + r->pos;
+    r->pos += v->size;
+
+    return 0;
 }
+static inline int get_piece(bit_reader_t* br, tetromino* t) {
 
-// TODO: Handle errors here
-// Auto disconnect maybe
-void deserialize_field(reader_t* buffer, const field_desc_t* field, void* base)
-{
-    void* field_ptr = (char*)base + field->offset;
-
-    uint32_t v;
-    float v2;
-    time_t v3;
-    char* str;
-    uint16_t len;
-
-    switch (field->type)
-    {
-        case FIELD_TYPE_INT:
-            
-            read_u32(buffer, &v);
-            *(int*)field_ptr = v;
-
-            break;
-        case FIELD_TYPE_FLOAT:
-
-            read_bytes(buffer, &v2, sizeof(float));        
-            *(float*)field_ptr = v2;
-            
-            break;
-        case FIELD_TYPE_STR:
-
-            read_u16(buffer, &len);
-            char* str = (char*) malloc(len + 1);
-            assert(str);
-
-            read_bytes(buffer, str, len);
-            str[len] = '\0';
-
-            *(char**)field_ptr = str;
-                        
-            break;
-        case FIELD_TYPE_TIME:
-
-            read_bytes(buffer, &v3, sizeof(time_t));
-            *(time_t*)field_ptr = v3;
-            
-            break;
+    uint32_t type, rot, x, y;
+    if (bit_read(br, 4, &type) || bit_read(br, 2, &rot) ||
+        bit_read(br, 8, &x) || bit_read(br, 8, &y))
+        return 1;
+
+    // Pieces index the tetromino table, never trust them
+    if (type >= NUM_TETROMINOS) return 1;
+
+    t->type = (tetromino_type) type;
+    t->rot = (int) rot;
+    t->pos.x = (int8_t) x;
+    t->pos.y = (int8_t) y;
+
+    return 0;
+}
+static inline int get_snapshot(reader_t* r, tetris_snapshot* v, arena_t* a) {
+    (void) a;
+
+    memset(v, 0, sizeof(*v));
+
+    bit_reader_t br;
+    bit_reader_init(&br, r);
+
+    uint32_t x;
+    for (size_t i = 0; i < ROWS * COLS; i++) {
+        if (bit_read(&br, CELL_BITS, &x) || x > TET_GARBAGE) return 1;
+        v->board[i] = (char) x;
     }
+
+    if (get_piece(&br, &v->current) || get_piece(&br, &v->next) || get_piece(&br, &v->hold))
+        return 1;
+
+    if (bit_read(&br, 1, &x)) return 1;
+    v->game_over = (char) x;
+    if (bit_read(&br, 1, &x)) return 1;
+    v->has_held = (char) x;
+    if (bit_read(&br, 1, &x)) return 1;
+    v->has_hold = (char) x;
+    if (bit_read(&br, 8, &x)) return 1;
+    v->lock_grace_counter = (short) x;
+    if (bit_read(&br, 3, &x)) return 1;
+    v->rotations_tried = (char) x;
+    if (bit_read(&br, 2, &x)) return 1;
+    v->old_rot = (char) x;
+
+    if (read_u32(r, &x)) return 1;
+    v->rng.seed = x;
+
+    if (read_varint(r, &v->points) ||
+        read_varint(r, &v->level) ||
+        read_varint(r, &v->level_goal) ||
+        read_varint(r, &v->stats.lines_cleared) ||
+        read_varint(r, &v->stats.singles) ||
+        read_varint(r, &v->stats.doubles) ||
+        read_varint(r, &v->stats.triples) ||
+        read_varint(r, &v->stats.tetris))
+        return 1;
+
+    return 0;
 }
+static inline int get_batch(reader_t* r, input_batch_t* v, arena_t* a) {
+    (void) a;
+
+    // Variable sized, has to check as it goes
+    uint32_t t, count, action, rows;
+    if (read_varint(r, &v->first_seq)) return 1;
+    if (read_varint(r, &t)) return 1;
 
-void deserialize_packet(reader_t* buffer, packet_types_t* out) {
+    bit_reader_t br;
+    bit_reader_init(&br, r);
+    if (bit_read(&br, INPUT_OPCODE_BITS, &count)) return 1;
+
+    v->count = (uint8_t) count;
+    for (uint8_t i = 0; i < v->count; i++) {
+        if (bit_read(&br, INPUT_OPCODE_BITS, &action)) return 1;
+        if (action >= NUM_INPUT_EVENTS) return 1;
+
+        rows = 0;
+        if (action == IE_GRAVITY && bit_read(&br, INPUT_OPCODE_BITS, &rows)) return 1;
+
+        v->action[i] = (uint8_t) action;
+        v->rows[i] = (uint8_t) (rows + 1);
+    }
+
+    for (uint8_t i = 0; i < v->count; i++) {
+
+        uint32_t dt = 0;
+        if (i > 0 && read_varint(r, &dt)) return 1;
+
+        t += dt;
+        v->time[i] = t;
+    }
+
+    return 0;
+}
+
+static inline int get_run(reader_t* r, input_run_t* v, arena_t* a) {
+    (void) a;
+
+    if (read_varint(r, &v->first_tick)) return 1;
+    if (reader_require(r, sizeof(uint8_t))) return 1;
+
+    get_bytes(r, &v->count, sizeof(uint8_t));
+    if (v->count > MAX_RUN_INPUTS) return 1;
+
+    bit_reader_t br;
+    bit_reader_init(&br, r);
+    for (uint8_t i = 0; i < v->count; i++) {
+
+        uint32_t pressed, mask = 0;
+        if (bit_read(&br, 1, &pressed)) return 1;
+        if (pressed && bit_read(&br, RUN_MASK_BITS, &mask)) return 1;
+
+        v->mask[i] = (uint16_t) (mask << 1);
+    }
+
+    return 0;
+}
+
+// Pick the codec for a field based on its type
+#define FIELD_CODEC(op, x) _Generic((x),    \
+    int: op##_int,                          \
+    uint8_t: op##_u8,                       \
+    float: op##_float,                      \
+    const char*: op##_str,                  \
+    time_t: op##_time,                      \
+    uint32_t: op##_varint_field,            \
+    uint64_t: op##_u64,                     \
+    input_batch_t: op##_batch,              \
+    bytes_t: op##_bytes_field,              \
+    tetris_snapshot: op##_snapshot,         \
+    input_run_t: op##_run                   \
+)
+
+// Bytes a field takes at least, known at compile time
+#define FIELD_MIN_SIZE(x) _Generic((x),     \
+    int: sizeof(uint32_t),                  \
+    uint8_t: sizeof(uint8_t),               \
+    float: sizeof(float),                   \
+    const char*: sizeof(uint16_t),          \
+    time_t: 2 * sizeof(uint32_t),           \
+    uint32_t: 1,                            \
+    uint64_t: sizeof(uint64_t),             \
+    input_batch_t: 3,                       \
+    bytes_t: sizeof(uint16_t),              \
+    tetris_snapshot: SNAPSHOT_FIXED_SIZE + SNAPSHOT_COUNTERS, \
+    input_run_t: 2                          \
+)
+
+#define DO_FIELD_SIZE(fname, p)         + FIELD_CODEC(size, (p)->fname)(&(p)->fname)
+#define DO_FIELD_MIN_SIZE(fname, pname) + FIELD_MIN_SIZE(((pname*) NULL)->fname)
+#define DO_FIELD_PUT(fname, b, p)       FIELD_CODEC(put, (p)->fname)((b), &(p)->fname);
+#define DO_FIELD_GET(fname, r, p, a)    if (FIELD_CODEC(get, (p)->fname)((r), &(p)->fname, (a))) return 1;
+
+// Generate straight line codecs for every packet type, no per field branching
+// The whole packet is bounds checked once before anything is written or read
+#define DO_PACKET_CODEC(uc, lc, i, ...)                                         \
+    static inline size_t lc##_size(const lc##_t* p) {                           \
+        (void) p;                                                               \
+        return 0 uc##_FIELDS(DO_FIELD_SIZE, p);                                 \
+    }                                                                           \
+    static inline void lc##_encode(buffer_t* b, const lc##_t* p) {              \
+        (void) b; (void) p;                                                     \
+        uc##_FIELDS(DO_FIELD_PUT, b, p)                                         \
+    }                                                                           \
+    static inline int lc##_decode(reader_t* r, lc##_t* p, arena_t* a) {         \
+        (void) p; (void) a;                                                     \
+        if (reader_require(r, 0 uc##_FIELDS(DO_FIELD_MIN_SIZE, lc##_t)))        \
+            return 1;                                                           \
+        uc##_FIELDS(DO_FIELD_GET, r, p, a)                                      \
+        return 0;                                                               \
+    }
+
+PACKET_TYPES_ITER(DO_PACKET_CODEC)
+
+size_t packet_size(const packet_types_t* packet) {
+
+    // Packet type comes first
+    size_t size = sizeof(uint16_t);
+
+#define DO_SIZE_CASE(uc, lc, i, ...) case PACKET_TYPE_##uc: return size + lc##_size(&packet->lc);
+    switch (packet->type) {
+        PACKET_TYPES_ITER(DO_SIZE_CASE)
+    }
+#undef DO_SIZE_CASE
+
+    return size;
+}
+
+int serialize_packet(buffer_t* buffer, const packet_types_t* packet) {
+
+    if (buffer_reserve(buffer, packet_size(packet)))
+        return 1;
+
+    // Write packet type first
+    put_u16(buffer, (uint16_t) packet->type);
+
+#define DO_ENCODE_CASE(uc, lc, i, ...) case PACKET_TYPE_##uc: lc##_encode(buffer, &packet->lc); break;
+    switch (packet->type) {
+        PACKET_TYPES_ITER(DO_ENCODE_CASE)
+    }
+#undef DO_ENCODE_CASE
+
+    return 0;
+}
+
+int deserialize_packet(reader_t* buffer, packet_types_t* out, arena_t* arena) {
 
     // Read packet type
     uint16_t pt;
-    read_u16(buffer, &pt);
+    if (read_u16(buffer, &pt)) return 1;
     
     out->type = (packet_type) pt;
-    const type_desc_t* desc = &types[pt];
 
-    void* payload = (void*) &out->none;
-
-    for (size_t i = 0; i < 16 && desc->fields[i].name; i++) {
-        deserialize_field(buffer, &desc->fields[i], payload);
+    // Never trust whatever id came off the wire
+#define DO_DECODE_CASE(uc, lc, i, ...) case PACKET_TYPE_##uc: return lc##_decode(buffer, &out->lc, arena);
+    switch (out->type) {
+        PACKET_TYPES_ITER(DO_DECODE_CASE)
     }
-}
\ No newline at end of file
+#undef DO_DECODE_CASE
+
+    return 1;
+}
+
+size_t snapshot_size(const tetris_snapshot* s) {
+    return size_snapshot(s);
+}
+
+int serialize_snapshot(buffer_t* buffer, const tetris_snapshot* s) {
+
+    if (buffer_reserve(buffer, size_snapshot(s)))
+        return 1;
+
+    put_snapshot(buffer, s);
+    return 0;
+}
+
+int deserialize_snapshot(reader_t* buffer, tetris_snapshot* s) {
+
+    if (reader_require(buffer, SNAPSHOT_FIXED_SIZE + SNAPSHOT_COUNTERS))
+        return 1;
+
+    return get_snapshot(buffer, s, NULL);
+}
@@ -10,9 +10,12 @@
 
 #include "packet_payloads.h"
 #include "buffer.h"
+#include "arena.h"
 
 #include <stddef.h>
 
+// Stays under the ~1200 bytes of UDP payload that make it anywhere without fragmenting,
+// so a send buffer this big is MTU sized
 #define MAX_PACKET_SIZE 1024
 
 // thanks jdh, i hate it https://gist.github.com/jdah/1ae0048faa2c627f7f5cb1b68f7a2c02
@@ -31,7 +34,19 @@
     _F(NONE,                none,           0, __VA_ARGS__)             \
     _F(CONNECT,             connect,        1, __VA_ARGS__)             \
     _F(DISCONNECT,          disconnect,     2, __VA_ARGS__)             \
-    _F(SEND_INPUT,          send_input,     3, __VA_ARGS__)
+    _F(SEND_INPUT,          send_input,     3, __VA_ARGS__)             \
+    _F(GAME_STATE,          game_state,     4, __VA_ARGS__)             \
+    _F(RELIABLE,            reliable,       5, __VA_ARGS__)             \
+    _F(ACK,                 ack,            6, __VA_ARGS__)             \
+    _F(ROLLBACK_INPUT,      rollback_input, 7, __VA_ARGS__)             \
+    _F(PING,                ping,           8, __VA_ARGS__)             \
+    _F(PONG,                pong,           9, __VA_ARGS__)             \
+    _F(SPECTATE,            spectate,       10, __VA_ARGS__)            \
+    _F(SPECTATE_FRAME,      spectate_frame, 11, __VA_ARGS__)            \
+    _F(REJECT,              reject,         12, __VA_ARGS__)            \
+    _F(VERSUS_JOIN,         versus_join,    13, __VA_ARGS__)            \
+    _F(VERSUS_START,        versus_start,   14, __VA_ARGS__)            \
+    _F(VERSUS_LEAVE,        versus_leave,   15, __VA_ARGS__)
 
 #define DECL_TYPES_ENUM_MEMBER(uc, lc, i, ...)  \
     PACKET_TYPE_##uc = i,
@@ -55,19 +70,34 @@ typedef struct packet_types {
 
 typedef enum field_type {
     FIELD_TYPE_INT,
+    FIELD_TYPE_U8,
+    FIELD_TYPE_VARINT,
+    FIELD_TYPE_U64,
     FIELD_TYPE_FLOAT,
     FIELD_TYPE_STR,
-    FIELD_TYPE_TIME
+    FIELD_TYPE_TIME,
+    FIELD_TYPE_INPUT_BATCH,
+    FIELD_TYPE_BYTES,
+    FIELD_TYPE_SNAPSHOT,
+    FIELD_TYPE_INPUT_RUN
 } field_type_t;
 
 
 // Convert primitive type to enum type
+// uint32_t fields go out as varints, they're mostly small counters
+// uint64_t are hashes, random by nature, so they go out raw
 #define TYPE_TO_FIELD_TYPE(x) _Generic(*((x*) NULL),    \
     int: FIELD_TYPE_INT,                                \
+    uint8_t: FIELD_TYPE_U8,                             \
     float: FIELD_TYPE_FLOAT,                            \
     const char*: FIELD_TYPE_STR,                        \
     time_t: FIELD_TYPE_TIME,                            \
-    input_event_type: FIELD_TYPE_INT                    \
+    uint32_t: FIELD_TYPE_VARINT,                        \
+    uint64_t: FIELD_TYPE_U64,                           \
+    input_batch_t: FIELD_TYPE_INPUT_BATCH,              \
+    bytes_t: FIELD_TYPE_BYTES,                          \
+    tetris_snapshot: FIELD_TYPE_SNAPSHOT,               \
+    input_run_t: FIELD_TYPE_INPUT_RUN                   \
 )
 
 // Now this is some funny reflection overhead struct thing
@@ -115,11 +145,21 @@ typedef struct type_desc
 extern type_desc_t types[];
 
 // Serialization
+// The codecs are generated at compile time from the *_FIELDS lists, see packets.c
 
-void serialize_field(buffer_t* buffer, const field_desc_t* field, void* base);
-void serialize_packet(buffer_t* buffer, packet_types_t* packet);
+// Exact amount of bytes the packet takes on the wire
+size_t packet_size(const packet_types_t* packet);
 
-void deserialize_field(reader_t* buffer, const field_desc_t* field, void* base);
-void deserialize_packet(reader_t* buffer, packet_types_t* out);
+// Return non zero if the packet does not fit the buffer, nothing is written in that case
+int serialize_packet(buffer_t* buffer, const packet_types_t* packet);
+
+// Deserialization never allocates, strings are placed in the given arena
+// Return non zero on malformed or truncated packets
+int deserialize_packet(reader_t* buffer, packet_types_t* out, arena_t* arena);
+
+// Board snapshots on their own, same encoding as inside packets
+size_t snapshot_size(const tetris_snapshot* s);
+int serialize_snapshot(buffer_t* buffer, const tetris_snapshot* s);
+int deserialize_snapshot(reader_t* buffer, tetris_snapshot* s);
 
 #endif
\ No newline at end of file
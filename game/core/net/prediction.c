@@ -0,0 +1,47 @@
+/**
+ * @file        prediction.c
+ * @brief       Client side prediction and server reconciliation
+ */
+
+#include "prediction.h"
+
+#include <string.h>
+
+#define HISTORY_INDEX(seq) ((seq) & (INPUT_HISTORY_SIZE - 1))
+
+void prediction_record(tetris_board* game) {
+
+    uint32_t seq = game->net.applied_seq++;
+    tetris_save_snapshot(game, &game->net.predicted[HISTORY_INDEX(seq)]);
+}
+
+void prediction_reconcile(tetris_board* game, uint32_t seq, const tetris_snapshot* state) {
+
+    // Server hasn't applied anything yet
+    if (seq == 0) return;
+
+    uint32_t last = seq - 1;
+
+    // Inputs are sent before we get to apply them, so the server can be ahead
+    // of us for a frame, the next state will cover it
+    if ((int32_t) (game->net.applied_seq - seq) < 0) return;
+
+    // Too old, the prediction for it was overwritten already
+    if (game->net.applied_seq - last > INPUT_HISTORY_SIZE) return;
+
+    tetris_snapshot* predicted = &game->net.predicted[HISTORY_INDEX(last)];
+    if (memcmp(predicted, state, sizeof(*state)) == 0) return;
+
+    // We got it wrong, rewind to the server's state
+    game->net.mispredictions++;
+    tetris_load_snapshot(game, state);
+    *predicted = *state;
+
+    // And replay everything it hasn't seen yet, if we still have it
+    if (game->net.next_seq - seq > INPUT_HISTORY_SIZE) return;
+
+    for (uint32_t s = seq; s != game->net.applied_seq; s++) {
+        tetris_apply_input(game, game->net.history_action[HISTORY_INDEX(s)]);
+        tetris_save_snapshot(game, &game->net.predicted[HISTORY_INDEX(s)]);
+    }
+}
@@ -0,0 +1,29 @@
+/**
+ * @file        prediction.h
+ * @brief       Client side prediction and server reconciliation
+ */
+
+#ifndef PREDICTION_H
+#define PREDICTION_H
+
+#include "../tetris.h"
+
+#include <stdint.h>
+
+/**
+ * Bound boards apply their inputs right away instead of waiting for the server,
+ * so playing online feels the same as offline. Every input has a sequence number
+ * and we keep the board as it was right after applying it.
+ *
+ * The server sends back its own state along with the sequence it's at. If our
+ * prediction for that input matches there's nothing to do, otherwise we take the
+ * server's state and replay every input it hasn't seen on top of it.
+ */
+
+// Store the state after the input that was just applied
+void prediction_record(tetris_board* game);
+
+// The server's board looked like `state` after applying every input bellow `seq`
+void prediction_reconcile(tetris_board* game, uint32_t seq, const tetris_snapshot* state);
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * @file        reliable.c
+ * @brief       Reliable ordered channel on top of UDP, for control messages
+ */
+
+#include "reliable.h"
+
+#include <string.h>
+
+// Sequences wrap, compare them through the signed difference
+static inline int16_t seq_diff(uint16_t a, uint16_t b) {
+    return (int16_t) (uint16_t) (a - b);
+}
+
+void reliable_init(reliable_channel_t* ch) {
+
+    memset(ch, 0, sizeof(*ch));
+    ch->resend_ms = RELIABLE_RESEND_MS;
+}
+
+const reliable_message_t* reliable_queue(reliable_channel_t* ch, const void* data, size_t size, uint32_t now) {
+
+    if (size > RELIABLE_MAX_MESSAGE)
+        return NULL;
+
+    reliable_message_t* m = &ch->sent[ch->next_seq % RELIABLE_WINDOW];
+    if (m->used)
+        return NULL;
+
+    memcpy(m->data, data, size);
+    m->size = (uint16_t) size;
+    m->seq = ch->next_seq++;
+    m->sent_time = now;
+    m->used = 1;
+
+    return m;
+}
+
+static void ack_one(reliable_channel_t* ch, uint16_t seq) {
+
+    reliable_message_t* m = &ch->sent[seq % RELIABLE_WINDOW];
+    if (m->used && m->seq == seq)
+        m->used = 0;
+}
+
+void reliable_on_ack(reliable_channel_t* ch, uint16_t ack, uint32_t bits) {
+
+    // Ignore acks for things we never sent
+    if (seq_diff(ch->next_seq, ack) <= 0)
+        return;
+
+    ack_one(ch, ack);
+    for (int n = 0; n < RELIABLE_WINDOW; n++)
+        if (bits & (1u << n))
+            ack_one(ch, (uint16_t) (ack - 1 - n));
+}
+
+int reliable_pending(const reliable_channel_t* ch) {
+
+    for (int i = 0; i < RELIABLE_WINDOW; i++)
+        if (ch->sent[i].used)
+            return 1;
+
+    return 0;
+}
+
+const reliable_message_t* reliable_next_resend(reliable_channel_t* ch, uint32_t now, int* cursor) {
+
+    for (; *cursor < RELIABLE_WINDOW; (*cursor)++) {
+        reliable_message_t* m = &ch->sent[*cursor];
+        if (m->used && now - m->sent_time >= ch->resend_ms) {
+            m->sent_time = now;
+            (*cursor)++;
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+static void mark_received(reliable_channel_t* ch, uint16_t seq) {
+
+    if (!ch->has_remote) {
+        ch->has_remote = 1;
+        ch->remote_seq = seq;
+        ch->remote_bits = 0;
+        return;
+    }
+
+    int16_t diff = seq_diff(seq, ch->remote_seq);
+    if (diff > 0) {
+        // Newer, slide the window, the old newest becomes bit diff - 1
+        ch->remote_bits = diff > RELIABLE_WINDOW ? 0 :
+            ((diff == RELIABLE_WINDOW ? 0 : ch->remote_bits << diff) | (1u << (diff - 1)));
+        ch->remote_seq = seq;
+    } else if (diff < 0 && -diff <= RELIABLE_WINDOW) {
+        ch->remote_bits |= 1u << (-diff - 1);
+    }
+}
+
+int reliable_on_receive(reliable_channel_t* ch, uint16_t seq, const void* data, size_t size) {
+
+    if (size > RELIABLE_MAX_MESSAGE)
+        return 1;
+
+    // Too far ahead, we'd have nowhere to hold it, the sender will try again
+    int16_t ahead = seq_diff(seq, ch->deliver_seq);
+    if (ahead >= RELIABLE_WINDOW)
+        return 1;
+
+    mark_received(ch, seq);
+
+    // Already delivered
+    if (ahead < 0)
+        return 1;
+
+    reliable_message_t* m = &ch->received[seq % RELIABLE_WINDOW];
+    if (m->used && m->seq == seq)
+        return 1;
+
+    memcpy(m->data, data, size);
+    m->size = (uint16_t) size;
+    m->seq = seq;
+    m->used = 1;
+
+    return 0;
+}
+
+const reliable_message_t* reliable_deliver(reliable_channel_t* ch) {
+
+    reliable_message_t* m = &ch->received[ch->deliver_seq % RELIABLE_WINDOW];
+    if (!m->used || m->seq != ch->deliver_seq)
+        return NULL;
+
+    m->used = 0;
+    ch->deliver_seq++;
+
+    return m;
+}
+
+void reliable_ack_header(const reliable_channel_t* ch, uint32_t* ack, uint32_t* bits) {
+
+    // Nothing received yet, ack the one before the first so nothing matches
+    *ack = ch->has_remote ? ch->remote_seq : (uint16_t) (ch->deliver_seq - 1);
+    *bits = ch->has_remote ? ch->remote_bits : 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file        reliable.h
+ * @brief       Reliable ordered channel on top of UDP, for control messages
+ */
+
+#ifndef RELIABLE_H
+#define RELIABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Inputs and state are fine getting lost, they get resent or superseded anyway.
+ * Control messages (connect, disconnect...) are not, so those go through here.
+ *
+ * Every message gets a sequence number, the receiver answers with the newest sequence
+ * it got plus a bitfield of the 32 before it (Quake3/Gaffer style), which is cheap
+ * enough to stick on every packet going the other way.
+ * Anything not acked in time is sent again, and the receiver holds messages until
+ * the ones before them arrive so the application sees them in order, exactly once.
+ */
+#define RELIABLE_WINDOW 32 // Has to match the ack bitfield width
+#define RELIABLE_MAX_MESSAGE 128
+#define RELIABLE_RESEND_MS 100
+
+typedef struct {
+    uint8_t data[RELIABLE_MAX_MESSAGE];
+    uint16_t size;
+    uint16_t seq;
+    uint32_t sent_time;
+    char used;
+} reliable_message_t;
+
+typedef struct {
+
+    // Sending side
+    uint16_t next_seq;
+    uint32_t resend_ms; // Retransmit timeout
+    reliable_message_t sent[RELIABLE_WINDOW];
+
+    // Receiving side
+    char has_remote;
+    uint16_t remote_seq; // Newest sequence received
+    uint32_t remote_bits; // Bit n is set if remote_seq - 1 - n was received
+    uint16_t deliver_seq; // Next sequence handed to the application
+    reliable_message_t received[RELIABLE_WINDOW];
+
+} reliable_channel_t;
+
+void reliable_init(reliable_channel_t* ch);
+
+// Sending
+// Store a message until it is acked, returns NULL if the window is full
+// The returned message should be sent right away
+const reliable_message_t* reliable_queue(reliable_channel_t* ch, const void* data, size_t size, uint32_t now);
+
+// The remote got `ack` and every ack - 1 - n with bit n set
+void reliable_on_ack(reliable_channel_t* ch, uint16_t ack, uint32_t bits);
+
+// Something sent wasn't acked yet
+int reliable_pending(const reliable_channel_t* ch);
+
+// Iterate messages that timed out, start with *cursor = 0 and send each returned message
+const reliable_message_t* reliable_next_resend(reliable_channel_t* ch, uint32_t now, int* cursor);
+
+// Receiving
+// Returns 0 if the message was new and is now waiting for delivery
+// Duplicates still need to be acked, the sender probably lost our ack
+int reliable_on_receive(reliable_channel_t* ch, uint16_t seq, const void* data, size_t size);
+
+// Next message in order, NULL if there's a hole, valid until the next reliable_on_receive
+const reliable_message_t* reliable_deliver(reliable_channel_t* ch);
+
+// What to piggyback on outgoing packets
+void reliable_ack_header(const reliable_channel_t* ch, uint32_t* ack, uint32_t* bits);
+
+#endif
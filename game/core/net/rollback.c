@@ -0,0 +1,282 @@
+/**
+ * @file        rollback.c
+ * @brief       Rollback session for head to head versus
+ */
+
+#include "rollback.h"
+#include "client.h"
+
+#include <string.h>
+
+#define TICK_INDEX(tick) ((tick) & (ROLLBACK_WINDOW - 1))
+
+// Lines sent to the opponent for clearing 0, 1, 2, 3 and 4 lines at once
+static const unsigned int ATTACK_TABLE[TETRIS + 1] = { 0, 0, 1, 2, 4 };
+
+void rollback_init(rollback_session_t* s, unsigned int seed) {
+
+    memset(s, 0, sizeof(*s));
+    s->max_rollback = ROLLBACK_DEFAULT_MAX_ROLLBACK;
+
+    for (int i = 0; i < ROLLBACK_MAX_PLAYERS; i++)
+        rng_init(&s->garbage_rng[i], seed);
+}
+
+int rollback_add_player(rollback_session_t* s, tetris_board* board, rollback_player_type type, unsigned int input_delay) {
+
+    if (s->player_count >= ROLLBACK_MAX_PLAYERS)
+        return -1;
+
+    rollback_player_t* p = &s->players[s->player_count];
+    memset(p, 0, sizeof(*p));
+
+    p->board = board;
+    p->type = type;
+    p->input_delay = input_delay > ROLLBACK_MAX_INPUT_DELAY ? ROLLBACK_MAX_INPUT_DELAY : input_delay;
+
+    // Inputs go in through the session from now on
+    mpsc_init(&board->input_queue);
+
+    s->has_remote |= type == ROLLBACK_REMOTE;
+    return s->player_count++;
+}
+
+static void save_frame(rollback_session_t* s, uint32_t tick) {
+
+    rollback_frame_t* f = &s->frames[TICK_INDEX(tick)];
+    for (uint8_t i = 0; i < s->player_count; i++) {
+        tetris_board* board = s->players[i].board;
+        tetris_save_snapshot(board, &f->state[i]);
+        f->counters[i] = board->counters;
+        f->garbage_rng[i] = s->garbage_rng[i];
+    }
+}
+
+static void load_frame(rollback_session_t* s, uint32_t tick) {
+
+    const rollback_frame_t* f = &s->frames[TICK_INDEX(tick)];
+    for (uint8_t i = 0; i < s->player_count; i++) {
+        tetris_board* board = s->players[i].board;
+        tetris_load_snapshot(board, &f->state[i]);
+        board->counters = f->counters[i];
+        s->garbage_rng[i] = f->garbage_rng[i];
+    }
+}
+
+// Simulate tick s->tick with whatever inputs we have for it, real or predicted
+static void step(rollback_session_t* s) {
+
+    uint32_t t = s->tick;
+    save_frame(s, t);
+
+    unsigned int attack[ROLLBACK_MAX_PLAYERS] = {0};
+    for (uint8_t i = 0; i < s->player_count; i++) {
+
+        rollback_player_t* p = &s->players[i];
+        tetris_board* board = p->board;
+
+        // Nothing known yet, they probably didn't press anything
+        if (p->type == ROLLBACK_REMOTE && (int32_t) (t - p->confirmed_tick) >= 0)
+            p->input[TICK_INDEX(t)] = 0;
+
+        // Topped out boards don't take input anymore
+        if (board->game_over)
+            continue;
+
+        uint16_t mask = p->input[TICK_INDEX(t)];
+        for (int action = IE_GRAVITY + 1; action < NUM_INPUT_EVENTS; action++)
+            if (mask & ROLLBACK_INPUT_BIT(action))
+                mpsc_push(&board->input_queue, (input_record) {
+                    .tick = t,
+                    .seq = board->input_seq++,
+                    .action = (uint8_t) action,
+                    .source = p->type == ROLLBACK_REMOTE ? INPUT_SOURCE_REMOTE : INPUT_SOURCE_LOCAL,
+                });
+
+        unsigned int lines = board->stats.lines_cleared;
+        tetris_update(board, ROLLBACK_BOARD_TICKS);
+
+        // A reset takes the counter back down, that's no attack
+        lines = board->stats.lines_cleared > lines ? board->stats.lines_cleared - lines : 0;
+        attack[i] = ATTACK_TABLE[lines > TETRIS ? TETRIS : lines];
+    }
+
+    // Garbage lands after everyone moved so player order doesn't matter
+    for (uint8_t i = 0; i < s->player_count; i++) {
+        for (uint8_t j = 0; j < s->player_count; j++) {
+
+            tetris_board* target = s->players[j].board;
+            if (i == j || !attack[i] || target->game_over)
+                continue;
+
+            add_garbage(target, attack[i] < target->rows ? attack[i] : target->rows - 1, &s->garbage_rng[j]);
+        }
+    }
+
+    s->tick++;
+
+    // Local inputs for the tick that just came into range start out empty
+    for (uint8_t i = 0; i < s->player_count; i++) {
+        rollback_player_t* p = &s->players[i];
+        if (p->type == ROLLBACK_LOCAL)
+            p->input[TICK_INDEX(s->tick + p->input_delay)] = 0;
+    }
+}
+
+// Whether stepping one more tick keeps us inside what we're able to undo and resend
+static int can_advance(const rollback_session_t* s) {
+
+    for (uint8_t i = 0; i < s->player_count; i++) {
+
+        const rollback_player_t* p = &s->players[i];
+        if (p->type == ROLLBACK_REMOTE) {
+            if ((int32_t) (s->tick - p->confirmed_tick) >= (int32_t) s->max_rollback)
+                return 0;
+        } else if (s->has_remote) {
+            // Would overwrite an input the opponent doesn't have yet
+            if (s->tick + 1 + p->input_delay - p->acked_tick >= ROLLBACK_WINDOW)
+                return 0;
+        }
+    }
+
+    return 1;
+}
+
+// Take everything the local providers registered since last frame
+static void collect_local_inputs(rollback_session_t* s) {
+
+    for (uint8_t i = 0; i < s->player_count; i++) {
+
+        rollback_player_t* p = &s->players[i];
+        if (p->type != ROLLBACK_LOCAL)
+            continue;
+
+        input_record record;
+        uint16_t* mask = &p->input[TICK_INDEX(s->tick + p->input_delay)];
+        while (mpsc_pop(&p->board->input_queue, &record)) {
+            if (record.action != IE_GRAVITY)
+                *mask |= ROLLBACK_INPUT_BIT(record.action);
+        }
+    }
+}
+
+void rollback_advance(rollback_session_t* s, uint32_t us) {
+
+    collect_local_inputs(s);
+
+    // Redo everything since the first wrong guess, with what we know now
+    if (s->needs_rollback) {
+
+        uint32_t target = s->tick;
+        load_frame(s, s->rollback_tick);
+        s->tick = s->rollback_tick;
+
+        s->rollbacks++;
+        s->resimulated_ticks += target - s->tick;
+
+        while (s->tick != target)
+            step(s);
+
+        s->needs_rollback = 0;
+    }
+
+    // Counted on the board clock, a rollback tick is ROLLBACK_BOARD_TICKS of them
+    s->pending_ticks += tick_clock_advance(&s->clock, us);
+    if (s->pending_ticks > ROLLBACK_MAX_CATCHUP * ROLLBACK_BOARD_TICKS)
+        s->pending_ticks = ROLLBACK_MAX_CATCHUP * ROLLBACK_BOARD_TICKS;
+
+    while (s->pending_ticks >= ROLLBACK_BOARD_TICKS) {
+
+        // Too far ahead of the opponent, wait for them instead of guessing more
+        if (!can_advance(s)) {
+            s->stalls++;
+            break;
+        }
+
+        step(s);
+        s->pending_ticks -= ROLLBACK_BOARD_TICKS;
+    }
+}
+
+void rollback_send(rollback_session_t* s, udp_client* client) {
+
+    if (!s->has_remote)
+        return;
+
+    rollback_player_t* local = NULL;
+    rollback_player_t* remote = NULL;
+    for (uint8_t i = 0; i < s->player_count; i++) {
+        if (s->players[i].type == ROLLBACK_LOCAL && !local) local = &s->players[i];
+        if (s->players[i].type == ROLLBACK_REMOTE && !remote) remote = &s->players[i];
+    }
+
+    if (!local || !remote)
+        return;
+
+    // Inputs for ticks bellow this can't change anymore, everything past acked goes out again
+    uint32_t final = s->tick + local->input_delay;
+    uint32_t first = local->acked_tick;
+    if (final - first > MAX_RUN_INPUTS)
+        first = final - MAX_RUN_INPUTS;
+
+    packet_types_t packet = {
+        .type = PACKET_TYPE_ROLLBACK_INPUT,
+        .rollback_input = {
+            .ack = remote->confirmed_tick,
+            .inputs = {
+                .first_tick = first,
+                .count = (uint8_t) (final - first),
+            },
+        },
+    };
+
+    input_run_t* run = &packet.rollback_input.inputs;
+    for (uint8_t n = 0; n < run->count; n++)
+        run->mask[n] = local->input[TICK_INDEX(first + n)];
+
+    client_send(client, &packet);
+}
+
+void rollback_on_input(rollback_session_t* s, const rollback_input_t* packet) {
+
+    for (uint8_t i = 0; i < s->player_count; i++) {
+
+        rollback_player_t* p = &s->players[i];
+
+        if (p->type == ROLLBACK_LOCAL) {
+            if ((int32_t) (packet->ack - p->acked_tick) > 0)
+                p->acked_tick = packet->ack;
+            continue;
+        }
+
+        const input_run_t* run = &packet->inputs;
+        for (uint8_t n = 0; n < run->count; n++) {
+
+            uint32_t t = run->first_tick + n;
+
+            // Already have it
+            if ((int32_t) (t - p->confirmed_tick) < 0)
+                continue;
+
+            // Only take them in order, the gap will be resent
+            if (t != p->confirmed_tick)
+                break;
+
+            // Way ahead of us, the slot is still holding something we might rewind to
+            if (t - (s->tick - s->max_rollback) >= ROLLBACK_WINDOW)
+                break;
+
+            uint16_t* slot = &p->input[TICK_INDEX(t)];
+
+            // Already simulated with a guess, if it was wrong everything since is wrong too
+            if ((int32_t) (t - s->tick) < 0 && *slot != run->mask[n]) {
+                if (!s->needs_rollback || (int32_t) (t - s->rollback_tick) < 0)
+                    s->rollback_tick = t;
+                s->needs_rollback = 1;
+            }
+
+            *slot = run->mask[n];
+            p->confirmed_tick = t + 1;
+        }
+    }
+}
@@ -0,0 +1,121 @@
+/**
+ * @file        rollback.h
+ * @brief       Rollback session for head to head versus
+ */
+
+#ifndef ROLLBACK_H
+#define ROLLBACK_H
+
+#include "../tetris.h"
+#include "packet_payloads.h"
+
+#include <stdint.h>
+
+/**
+ * GGPO style, both sides simulate both boards. Local inputs are applied a few ticks
+ * late (the input delay) so they have time to reach the other side, and whatever
+ * the opponent did that we don't know yet is predicted as "nothing".
+ *
+ * When their real inputs show up and they disagree with the prediction we go back
+ * to the saved state for that tick and simulate everything again. Nothing is ever
+ * decided by a server here, it only relays, so both sides have to stay deterministic.
+ *
+ * 1v1 only, anything that comes in is the opponent's.
+ */
+
+// The simulation only moves in whole ticks of this length, no matter the frame rate
+#define ROLLBACK_TICK_RATE 60
+#define ROLLBACK_BOARD_TICKS (TETRIS_TICK_RATE / ROLLBACK_TICK_RATE) // Board ticks per rollback tick
+
+#define ROLLBACK_MAX_PLAYERS 2
+
+// Ticks worth of inputs and saved states, power of two
+#define ROLLBACK_WINDOW 32
+
+#define ROLLBACK_DEFAULT_INPUT_DELAY 2
+#define ROLLBACK_MAX_INPUT_DELAY 8
+
+// Most ticks resimulated in one frame, we stop predicting past this instead
+#define ROLLBACK_DEFAULT_MAX_ROLLBACK 8
+#define ROLLBACK_MAX_ROLLBACK (ROLLBACK_WINDOW / 4)
+
+// Most new ticks stepped in one frame, so a long hitch doesn't snowball
+#define ROLLBACK_MAX_CATCHUP 4
+
+// An input for one tick is a bitmask with a bit per input_event_type
+#define ROLLBACK_INPUT_BIT(action) ((uint16_t) (1u << (action)))
+
+struct udp_client;
+
+typedef enum {
+    ROLLBACK_LOCAL,
+    ROLLBACK_REMOTE
+} rollback_player_type;
+
+typedef struct {
+    tetris_board* board;
+    rollback_player_type type;
+    unsigned int input_delay; // Local only
+
+    uint16_t input[ROLLBACK_WINDOW]; // Indexed by tick
+
+    // Remote: inputs bellow this tick are real, the rest are predictions
+    uint32_t confirmed_tick;
+
+    // Local: the opponent has every input of ours bellow this tick
+    uint32_t acked_tick;
+} rollback_player_t;
+
+// Everything needed to go back to the start of a tick
+typedef struct {
+    tetris_snapshot state[ROLLBACK_MAX_PLAYERS];
+    tetris_counters counters[ROLLBACK_MAX_PLAYERS];
+    rng_table garbage_rng[ROLLBACK_MAX_PLAYERS];
+} rollback_frame_t;
+
+typedef struct rollback_session {
+    rollback_player_t players[ROLLBACK_MAX_PLAYERS];
+    uint8_t player_count;
+    char has_remote;
+
+    uint32_t tick; // Next tick to simulate
+    tick_clock clock;
+    uint32_t pending_ticks; // Board ticks of real time that don't make a whole tick yet
+
+    // Resimulation budget, ticks we may get ahead of the opponent's last known input
+    unsigned int max_rollback;
+
+    // Earliest tick that was simulated with a wrong prediction
+    char needs_rollback;
+    uint32_t rollback_tick;
+
+    // Garbage holes, seeded the same for everyone so both sides agree
+    rng_table garbage_rng[ROLLBACK_MAX_PLAYERS];
+
+    rollback_frame_t frames[ROLLBACK_WINDOW]; // Indexed by tick
+
+    // Stats
+    unsigned int rollbacks;
+    unsigned int resimulated_ticks;
+    unsigned int stalls;
+} rollback_session_t;
+
+void rollback_init(rollback_session_t* s, unsigned int seed);
+
+// Boards have to be initialized the same way on both sides and not bound to a server
+// Returns the player index, or -1 if the session is full
+int rollback_add_player(rollback_session_t* s, tetris_board* board, rollback_player_type type, unsigned int input_delay);
+
+/**
+ * Call once per frame after pumping input into the local boards.
+ * Takes whatever they registered, rolls back if needed and steps as many ticks as `us` microseconds cover
+ */
+void rollback_advance(rollback_session_t* s, uint32_t us);
+
+// Send our inputs the opponent hasn't acked yet, call once per frame after advancing
+void rollback_send(rollback_session_t* s, struct udp_client* client);
+
+// Inputs from the opponent, relayed by the server
+void rollback_on_input(rollback_session_t* s, const rollback_input_t* packet);
+
+#endif
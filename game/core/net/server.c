@@ -7,8 +7,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stddef.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -20,9 +23,22 @@
 
 #include "lobby.h"
 #include "net/packets.h"
+#include "net/reliable.h"
+#include "net/clock_sync.h"
+#include "net/spectate.h"
+#include "rng.h"
+#include "utils.h"
+#include "log.h"
 
 #define PORT 5000
 
+// Every match is a lobby of two, connections fill them in the order they come in
+#define MAX_LOBBIES 512
+
+// Peers that go quiet this long are dropped along with their players
+#define PEER_TIMEOUT_MS 10000
+#define PEER_SWEEP_MS 1000 // How often we look, the socket wakes us up at least this often
+
 thrd_t server_thread;
 
 struct server_data {
@@ -30,28 +46,34 @@ struct server_data {
     int sockfd;
 };
 
+#if LOG_ENABLED(LOG_LEVEL_DEBUG)
+
 void print_board(const tetris_board* game) {
     if (!game || !game->board) {
-        printf("[board not initialized]\n");
+        LOG_DEBUG("[board not initialized]");
         return;
     }
 
-    printf("\033[2J\033[H");  
-
-    printf("=== %s | lvl:%d pts:%d lines:%d %s ===\n",
+    LOG_DEBUG("=== %s | lvl:%d pts:%d lines:%d %s ===",
         game->name ? game->name : "?",
         game->level,
         game->points,
         game->stats.lines_cleared,
         game->game_over ? "GAME OVER" : "");
 
-    // Top border
-    printf("+");
-    for (size_t x = 0; x < game->cols; x++) printf("--");
-    printf("+\n");
+    // A line at a time, borders included
+    char line[2 * COLS + 3];
+    size_t n = 0;
+
+    line[n++] = '+';
+    for (size_t x = 0; x < game->cols; x++) { line[n++] = '-'; line[n++] = '-'; }
+    line[n++] = '+';
+    line[n] = '\0';
+    LOG_DEBUG("%s", line);
 
     for (size_t y = 0; y < game->rows; y++) {
-        printf("|");
+        n = 0;
+        line[n++] = '|';
         for (size_t x = 0; x < game->cols; x++) {
             char cell = index_cell(game, x, y);
 
@@ -66,24 +88,505 @@ void print_board(const tetris_board* game) {
                 }
             }
 
-            if (is_piece)        printf("[]");
-            else if (cell == 0)  printf(" .");
-            else                 printf("##");
+            const char* s = is_piece ? "[]" : cell == 0 ? " ." : "##";
+            line[n++] = s[0];
+            line[n++] = s[1];
         }
-        printf("|\n");
+        line[n++] = '|';
+        line[n] = '\0';
+        LOG_DEBUG("%s", line);
     }
 
     // Bottom border
-    printf("+");
-    for (size_t x = 0; x < game->cols; x++) printf("--");
-    printf("+\n");
+    n = 0;
+    line[n++] = '+';
+    for (size_t x = 0; x < game->cols; x++) { line[n++] = '-'; line[n++] = '-'; }
+    line[n++] = '+';
+    line[n] = '\0';
+    LOG_DEBUG("%s", line);
 
     // Next piece preview
-    printf("next: ");
     static const char* names[] = {"I","J","L","O","S","T","Z"};
-    if (game->next.type < NUM_TETROMINOS)
-        printf("%s", names[game->next.type]);
-    printf("\n\n");
+    LOG_DEBUG("next: %s", game->next.type < NUM_TETROMINOS ? names[game->next.type] : "");
+}
+
+// Raw bytes, 32 to a line
+static void print_bytes(const uint8_t* data, ssize_t size) {
+
+    char line[32 * 3 + 1];
+    for (ssize_t i = 0; i < size; i += 32) {
+        size_t n = 0;
+        for (ssize_t j = i; j < size && j < i + 32; j++)
+            n += snprintf(line + n, sizeof(line) - n, "%02X ", data[j]);
+        LOG_DEBUG("  %s", line);
+    }
+}
+
+#endif
+
+void server_send(struct server_data* data, const struct sockaddr_in* addr, packet_types_t* packet) {
+
+    uint8_t out[MAX_PACKET_SIZE];
+    buffer_t buffer = {
+        .data = out,
+        .capacity = sizeof(out),
+        .size = 0,
+    };
+
+    if (serialize_packet(&buffer, packet))
+        return;
+
+    sendto(data->sockfd, buffer.data, buffer.size, 0, (const struct sockaddr*) addr, sizeof(*addr));
+}
+
+// A remote socket talking to us, one client can bring several players
+typedef struct peer {
+    struct sockaddr_in addr;
+    reliable_channel_t channel;
+    clock_sync_t clock; // Round trip and clock offset to them
+    uint32_t last_seen;
+    char used;
+
+    lobby_t* lobby; // Where its players are, NULL until one gets in
+
+    // Versus, rollback inputs only ever go to the opponent they were paired with
+    char versus_waiting; // Asked for a match, nobody to pair them with yet
+    struct peer* opponent;
+
+    // Said they're done or got rejected, forgotten once they have everything we sent
+    // Anyone else is only forgotten when they time out, they may still be using the channel
+    char leaving;
+} peer_t;
+
+// A seat each, and half as many again for versus peers and ones on their way out
+#define MAX_PEERS (MAX_LOBBIES * 3)
+static peer_t peers[MAX_PEERS];
+
+// Addresses of the used peers packed into one word each, a lookup scans these
+// instead of dragging every peer's channels through the cache
+static uint64_t peer_keys[MAX_PEERS];
+
+static lobby_t lobbies[MAX_LOBBIES];
+
+// Spectators watch one match, the same one until it empties, then the first one being played
+static lobby_t* watched = &lobbies[0];
+
+// Spectators aren't peers, they never send anything but acks
+static spectate_server_t spectate;
+
+// Versus seeds, both sides get the same one and neither picks it
+static rng_table versus_rng;
+
+static int same_addr(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+// Never 0, ports aren't
+static uint64_t addr_key(const struct sockaddr_in* addr) {
+    return (uint64_t) addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+peer_t* find_peer(const struct sockaddr_in* addr, char create) {
+
+    uint64_t key = addr_key(addr);
+    int free_slot = -1;
+    for (int i = 0; i < MAX_PEERS; i++) {
+        if (peer_keys[i] == key)
+            return &peers[i];
+        if (!peer_keys[i] && free_slot < 0)
+            free_slot = i;
+    }
+
+    if (!create || free_slot < 0)
+        return NULL;
+
+    peer_keys[free_slot] = key;
+    peer_t* peer = &peers[free_slot];
+    peer->used = 1;
+    peer->lobby = NULL;
+    peer->versus_waiting = 0;
+    peer->opponent = NULL;
+    peer->leaving = 0;
+    peer->addr = *addr;
+    peer->last_seen = now_ms();
+    reliable_init(&peer->channel);
+    clock_sync_init(&peer->clock);
+
+    return peer;
+}
+
+static void free_peer(peer_t* peer) {
+    peer->used = 0;
+    peer_keys[peer - peers] = 0;
+}
+
+static int has_players(const peer_t* peer) {
+
+    if (!peer->lobby)
+        return 0;
+
+    for (int i = 0; i < 2; i++)
+        if (peer->lobby->players[i].game.name && same_addr(&peer->lobby->players[i].addr, &peer->addr))
+            return 1;
+
+    return 0;
+}
+
+// A client's players all play in the same match, the first one takes the first lobby with room
+static lobby_t* lobby_for(peer_t* peer) {
+
+    if (peer->lobby)
+        return lobby_full(peer->lobby) ? NULL : peer->lobby;
+
+    for (int i = 0; i < MAX_LOBBIES; i++)
+        if (!lobby_full(&lobbies[i]))
+            return &lobbies[i];
+
+    return NULL;
+}
+
+// Keeps watching the same match while anyone is still in it
+static lobby_t* watched_lobby(void) {
+
+    if (!lobby_empty(watched))
+        return watched;
+
+    for (int i = 0; i < MAX_LOBBIES; i++)
+        if (!lobby_empty(&lobbies[i]))
+            return watched = &lobbies[i];
+
+    return watched;
+}
+
+// Queued on the peer's channel, resent from service_peer until they ack it
+void server_send_reliable(struct server_data* data, peer_t* peer, packet_types_t* packet) {
+
+    uint8_t out[RELIABLE_MAX_MESSAGE];
+    buffer_t message = {
+        .data = out,
+        .capacity = sizeof(out),
+        .size = 0,
+    };
+
+    if (serialize_packet(&message, packet))
+        return;
+
+    const reliable_message_t* m = reliable_queue(&peer->channel, message.data, message.size, now_ms());
+    if (!m) {
+        LOG_WARN("Reliable channel to %s:%d is full, dropping packet %d",
+            inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port), packet->type);
+        return;
+    }
+
+    server_send(data, &peer->addr, &(packet_types_t) {
+        .type = PACKET_TYPE_RELIABLE,
+        .reliable = {
+            .seq = m->seq,
+            .payload = { .data = m->data, .size = m->size },
+        },
+    });
+}
+
+// Resend what they didn't ack in time and keep the clock in sync
+void service_peer(struct server_data* data, peer_t* peer, uint32_t now) {
+
+    int cursor = 0;
+    const reliable_message_t* m;
+    while ((m = reliable_next_resend(&peer->channel, now, &cursor)))
+        server_send(data, &peer->addr, &(packet_types_t) {
+            .type = PACKET_TYPE_RELIABLE,
+            .reliable = {
+                .seq = m->seq,
+                .payload = { .data = m->data, .size = m->size },
+            },
+        });
+
+    packet_types_t ping = { .type = PACKET_TYPE_PING };
+    if (clock_sync_ping(&peer->clock, &ping.ping, now))
+        server_send(data, &peer->addr, &ping);
+}
+
+// Out of the queue or the match, whoever they were playing is told
+void versus_leave(struct server_data* data, peer_t* peer) {
+
+    peer->versus_waiting = 0;
+
+    peer_t* opponent = peer->opponent;
+    if (!opponent)
+        return;
+
+    LOG_INFO("Versus: %s:%d left", inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port));
+    server_send_reliable(data, opponent, &(packet_types_t) { .type = PACKET_TYPE_VERSUS_LEAVE });
+
+    opponent->opponent = NULL;
+    peer->opponent = NULL;
+}
+
+// Pair them with whoever has been waiting, or have them wait
+void versus_join(struct server_data* data, peer_t* peer) {
+
+    // Joining again is starting over
+    versus_leave(data, peer);
+
+    peer_t* opponent = NULL;
+    for (int i = 0; i < MAX_PEERS && !opponent; i++)
+        if (peers[i].used && peers[i].versus_waiting && &peers[i] != peer)
+            opponent = &peers[i];
+
+    if (!opponent) {
+        peer->versus_waiting = 1;
+        return;
+    }
+
+    opponent->versus_waiting = 0;
+    opponent->opponent = peer;
+    peer->opponent = opponent;
+
+    packet_types_t start = {
+        .type = PACKET_TYPE_VERSUS_START,
+        .versus_start = { .seed = rng_step(&versus_rng) },
+    };
+    server_send_reliable(data, peer, &start);
+    server_send_reliable(data, opponent, &start);
+
+    LOG_INFO("Versus: %s:%d paired, seed %u",
+        inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port), start.versus_start.seed);
+}
+
+// Forget peers once they have no players left and got everything we had to tell them
+void release_peer_if_empty(peer_t* peer) {
+
+    if (!peer->leaving || peer->versus_waiting || peer->opponent)
+        return;
+
+    if (has_players(peer) || reliable_pending(&peer->channel))
+        return;
+
+    free_peer(peer);
+}
+
+// Gone without a word, they leave everything as if they had said so
+void drop_peer(struct server_data* data, peer_t* peer) {
+
+    LOG_INFO("Peer %s:%d timed out", inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port));
+
+    versus_leave(data, peer);
+
+    lobby_t* lobby = peer->lobby;
+    for (int i = 0; lobby && i < 2; i++)
+        if (lobby->players[i].game.name && same_addr(&lobby->players[i].addr, &peer->addr))
+            remove_player(lobby, &peer->addr, lobby->players[i].id);
+
+    free_peer(peer);
+}
+
+// Returns non zero if anyone was dropped
+int sweep_peers(struct server_data* data, uint32_t now) {
+
+    int dropped = 0;
+    for (int i = 0; i < MAX_PEERS; i++) {
+
+        peer_t* peer = &peers[i];
+        if (!peer->used)
+            continue;
+
+        if (now - peer->last_seen > PEER_TIMEOUT_MS) {
+            drop_peer(data, peer);
+            dropped = 1;
+            continue;
+        }
+
+        // Idle peers get pinged too, their pongs are what keeps them here
+        service_peer(data, peer, now);
+    }
+
+    return dropped;
+}
+
+void handle_packet(struct server_data* data, peer_t* peer, packet_types_t* packet, arena_t* arena) {
+
+    switch (packet->type)
+    {
+        case PACKET_TYPE_RELIABLE: {
+
+            reliable_t* r = &packet->reliable;
+            reliable_on_receive(&peer->channel, (uint16_t) r->seq, r->payload.data, r->payload.size);
+
+            // Always ack, even duplicates, the client probably lost the last one
+            packet_types_t ack = { .type = PACKET_TYPE_ACK };
+            reliable_ack_header(&peer->channel, &ack.ack.ack, &ack.ack.ack_bits);
+            server_send(data, &peer->addr, &ack);
+
+            // Hand out whatever is now in order
+            const reliable_message_t* m;
+            while ((m = reliable_deliver(&peer->channel))) {
+
+                reader_t reader = {
+                    .data = (uint8_t*) m->data,
+                    .size = m->size,
+                    .pos = 0
+                };
+
+                packet_types_t inner;
+                if (deserialize_packet(&reader, &inner, arena) || inner.type == PACKET_TYPE_RELIABLE) {
+                    LOG_WARN("Malformed reliable message, dropping");
+                    continue;
+                }
+
+                handle_packet(data, peer, &inner, arena);
+            }
+
+            release_peer_if_empty(peer);
+            break;
+        }
+
+        case PACKET_TYPE_ACK:
+            reliable_on_ack(&peer->channel, (uint16_t) packet->ack.ack, packet->ack.ack_bits);
+
+            // Might've been waiting on this to leave
+            release_peer_if_empty(peer);
+            break;
+
+        case PACKET_TYPE_CONNECT: {
+            LOG_INFO("CONNECT: username=%s player=%d time=%ld",
+                packet->connect.username, packet->connect.player, packet->connect.connect_time);
+
+            peer->leaving = 0;
+            lobby_t* lobby = lobby_for(peer);
+            if (lobby && !spawn_player(lobby, packet->connect.username, &peer->addr, packet->connect.player, 0)) {
+                peer->lobby = lobby;
+            } else {
+                // No room, they'd keep sending inputs for a player that isn't here otherwise
+                LOG_WARN("No room for %s, rejecting", packet->connect.username);
+                peer->leaving = !has_players(peer);
+                server_send_reliable(data, peer, &(packet_types_t) {
+                    .type = PACKET_TYPE_REJECT,
+                    .reject = { .player = packet->connect.player },
+                });
+            }
+            break;
+        }
+
+        case PACKET_TYPE_DISCONNECT:
+            LOG_INFO("DISCONNECT: player=%d time=%ld",
+                packet->disconnect.player, packet->disconnect.disconnect_time);
+
+            if (!peer->lobby)
+                break;
+
+            remove_player(peer->lobby, &peer->addr, packet->disconnect.player);
+            if (!has_players(peer)) {
+                peer->lobby = NULL;
+                peer->leaving = 1;
+            }
+            break;
+
+        case PACKET_TYPE_SEND_INPUT: {
+            input_batch_t* batch = &packet->send_input.inputs;
+            LOG_DEBUG("INPUT: player=%d count=%d", packet->send_input.player, batch->count);
+
+            // Inputs can beat the connect here, don't ack them so they get resent
+            lobby_player_t* p = peer->lobby ? get_player(peer->lobby, &peer->addr, packet->send_input.player) : NULL;
+            if (!p) {
+                LOG_DEBUG("  unknown player, dropping");
+                break;
+            }
+
+            // Gravity runs come apart again here, a row per input like the client applied them
+            uint8_t actions[MAX_BATCH_INPUTS * MAX_GRAVITY_RUN];
+            uint32_t times[MAX_BATCH_INPUTS * MAX_GRAVITY_RUN];
+            uint8_t count = 0;
+
+            uint32_t seq = batch->first_seq;
+            for (uint8_t i = 0; i < batch->count; i++) {
+                LOG_DEBUG("  input=%d x%d seq=%u time=%u", batch->action[i], batch->rows[i], seq, batch->time[i]);
+
+                for (uint8_t row = 0; row < batch->rows[i]; row++, seq++) {
+
+                    // Clients resend until acked, skip what we already applied
+                    if ((int32_t) (seq - p->next_seq) < 0)
+                        continue;
+
+                    // Fell out of the client's resend window, nothing to do but move on
+                    if (seq != p->next_seq)
+                        LOG_WARN("Player %d lost inputs %u..%u", p->id, p->next_seq, seq - 1);
+
+                    actions[count] = batch->action[i];
+                    times[count] = batch->time[i];
+                    count++;
+
+                    p->next_seq = seq + 1;
+                }
+            }
+
+            // Cooldowns are checked on the times the player made them at, all at once
+            // Whatever gets rejected still counts as received, the client reconciles it away
+            uint8_t accepted = lobby_accept_inputs(p, actions, times, count, now_ms());
+            if (accepted != count)
+                LOG_WARN("Player %d: rejected %d inputs", p->id, count - accepted);
+
+            for (uint8_t i = 0; i < accepted; i++)
+                mpsc_push(&p->game.input_queue, (input_record) {
+                    .tick = times[i],
+                    .seq = p->game.input_seq++,
+                    .action = actions[i],
+                    .source = INPUT_SOURCE_REMOTE,
+                });
+
+            tetris_process_input_queue(&p->game);
+            if (count)
+                lobby_record_hash(p, p->next_seq, batch->time[batch->count - 1]);
+
+            // Where they were at when they sent it, usually right after this batch, if we hashed the same spot
+            uint64_t ours;
+            uint32_t diverged_time;
+            if (lobby_check_hash(p, packet->send_input.hash_seq, packet->send_input.hash, &ours, &diverged_time))
+                LOG_WARN("Player %d desynced, first at input %u (time %u): ours %016llx theirs %016llx",
+                    p->id, packet->send_input.hash_seq, diverged_time,
+                    (unsigned long long) ours, (unsigned long long) packet->send_input.hash);
+
+            // Our state doubles as the input ack, the client reconciles against it
+            packet_types_t state = {
+                .type = PACKET_TYPE_GAME_STATE,
+                .game_state = {
+                    .player = p->id,
+                    .seq = p->next_seq,
+                },
+            };
+            tetris_save_snapshot(&p->game, &state.game_state.state);
+            reliable_ack_header(&peer->channel, &state.game_state.ack, &state.game_state.ack_bits);
+            server_send(data, &peer->addr, &state);
+            break;
+        }
+        case PACKET_TYPE_PONG:
+            clock_sync_on_pong(&peer->clock, &packet->pong, now_ms());
+            peer->channel.resend_ms = clock_sync_rto(&peer->clock, RELIABLE_RESEND_MS);
+
+            LOG_DEBUG("PONG: rtt=%.1fms jitter=%.1fms min=%ums offset=%dms",
+                peer->clock.rtt, peer->clock.jitter, peer->clock.min_rtt, peer->clock.offset);
+            break;
+
+        case PACKET_TYPE_VERSUS_JOIN:
+            peer->leaving = 0;
+            versus_join(data, peer);
+            break;
+
+        case PACKET_TYPE_VERSUS_LEAVE:
+            versus_leave(data, peer);
+            peer->leaving = 1;
+            break;
+
+        case PACKET_TYPE_ROLLBACK_INPUT:
+
+            // Both sides simulate the match themselves, we just pass inputs along
+            if (peer->opponent)
+                server_send(data, &peer->opponent->addr, packet);
+            break;
+
+        default:
+            LOG_WARN("NONE or unknown packet");
+            break;
+    }
 }
 
 int server_loop(void* args) {
@@ -91,34 +594,48 @@ int server_loop(void* args) {
     struct server_data* data = (struct server_data*) args;
     assert(data);
 
-    printf("Server listening on port %d\n", PORT);
+    LOG_INFO("Server listening on port %d", PORT);
+
+    for (int i = 0; i < MAX_LOBBIES; i++)
+        lobbies[i].id = i;
+
+    spectate_server_init(&spectate, data->sockfd);
+    rng_init(&versus_rng, (unsigned int) time(NULL));
+    uint32_t last_sweep = now_ms();
 
-    // The lobby this thread is responsible for
-    lobby_t lobby = {0};
+    // Per tick scratch memory for deserialized strings, reset every iteration
+    // so the packet path never goes through malloc/free
+    uint8_t scratch[MAX_PACKET_SIZE];
+    arena_t arena;
+    arena_init(&arena, scratch, sizeof(scratch));
 
     while (1)
     {
         uint8_t buffer[MAX_PACKET_SIZE];
+        arena_reset(&arena);
 
         socklen_t len = sizeof(data->cliaddr);
-        size_t recvlen = recvfrom(data->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr*)&data->cliaddr, &len);
+        ssize_t recvlen = recvfrom(data->sockfd, buffer, sizeof(buffer), 0, (struct sockaddr*)&data->cliaddr, &len);
+        uint32_t received = now_ms();
 
-        if (recvlen < 0) {
-            perror("recvfrom");
-            continue;
+        if (received - last_sweep >= PEER_SWEEP_MS) {
+            if (sweep_peers(data, received))
+                spectate_broadcast(&spectate, watched_lobby(), received);
+            last_sweep = received;
         }
 
-        printf("Raw bytes:\n");
-
-        for (size_t i = 0; i < recvlen; i++) {
-            printf("%02X ", buffer[i]);
+        if (recvlen < 0) {
+            // Timed out, only there so the sweep above gets to run
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOG_ERROR("recvfrom: %s", strerror(errno));
+            continue;
         }
-        printf("\n");
 
-        printf("Packet received (%ld bytes)\n", recvlen);
-        printf("  From: %s:%d\n",
-               inet_ntoa(data->cliaddr.sin_addr),
-               ntohs(data->cliaddr.sin_port));
+#if LOG_ENABLED(LOG_LEVEL_DEBUG)
+        LOG_DEBUG("Packet received (%ld bytes) from %s:%d", recvlen,
+            inet_ntoa(data->cliaddr.sin_addr), ntohs(data->cliaddr.sin_port));
+        print_bytes(buffer, recvlen);
+#endif
 
         reader_t reader = {
             .data = buffer,
@@ -128,49 +645,54 @@ int server_loop(void* args) {
 
         packet_types_t packet = {};
 
-        deserialize_packet(&reader, &packet);
-        //        printf("%d\n", packet.type);
-        
-        switch (packet.type)
-        {
-            case PACKET_TYPE_CONNECT:
-                printf("CONNECT: username=%s time=%ld\n",   
-                packet.connect.username, packet.connect.connect_time);
-
-                spawn_player(&lobby, packet.connect.username, 0);
-
-                free(packet.connect.username);
-                break;
-
-            case PACKET_TYPE_DISCONNECT:
-                printf("DISCONNECT: username=%s time=%ld\n",
-                    packet.disconnect.username, packet.disconnect.disconnect_time);
-
-                remove_player(&lobby, packet.disconnect.username);
-
-                free(packet.disconnect.username);
-                break;
+        if (deserialize_packet(&reader, &packet, &arena)) {
+            LOG_WARN("Malformed packet from %s:%d, dropping",
+                inet_ntoa(data->cliaddr.sin_addr), ntohs(data->cliaddr.sin_port));
+            continue;
+        }
 
-            case PACKET_TYPE_SEND_INPUT: {
-                printf("INPUT: username=%s input=%d\n",
-                    packet.send_input.username, packet.send_input.input);
+        // Anyone may ask for the time, it costs us nothing to keep
+        if (packet.type == PACKET_TYPE_PING) {
+            packet_types_t pong = { .type = PACKET_TYPE_PONG };
+            clock_sync_pong(&packet.ping, &pong.pong, received, now_ms());
+            server_send(data, &data->cliaddr, &pong);
+            continue;
+        }
 
-                lobby_player_t* p = get_player(&lobby, packet.send_input.username);
-                enqueue(&p->game.input_queue, packet.send_input.input);
-                tetris_process_input_queue(&p->game);
+        if (packet.type == PACKET_TYPE_SPECTATE) {
+            spectate_on_request(&spectate, &data->cliaddr, packet.spectate.ack, received);
+            continue;
+        }
 
-                free(packet.send_input.username);
-                break;
-            }
-            default:
-                printf("NONE or unknown packet\n");
-                break;
+        // Only control messages may introduce someone new
+        peer_t* peer = find_peer(&data->cliaddr, packet.type == PACKET_TYPE_RELIABLE);
+        if (!peer) {
+            LOG_DEBUG("Packet from unknown peer, dropping");
+            continue;
+        }
+        peer->last_seen = received;
+
+        // Where they play before this packet, a disconnect takes them out of it
+        lobby_t* lobby = peer->lobby;
+        handle_packet(data, peer, &packet, &arena);
+
+        // Anything that can change the boards makes a new frame for whoever is watching
+        // and so does moving on to another match once theirs is over
+        if (packet.type == PACKET_TYPE_SEND_INPUT || packet.type == PACKET_TYPE_RELIABLE) {
+            lobby_t* shown = watched;
+            lobby_t* current = watched_lobby();
+            if (current != shown || lobby == current || peer->lobby == current)
+                spectate_broadcast(&spectate, current, received);
         }
 
-        if (lobby.players[1].game.name)
-            print_board(&lobby.players[1].game);
+        // Whoever is talking gets serviced right away, everyone else on the next sweep
+        if (peer->used)
+            service_peer(data, peer, now_ms());
 
-        printf("\n");
+#if LOG_ENABLED(LOG_LEVEL_DEBUG)
+        if (watched->players[1].game.name)
+            print_board(&watched->players[1].game);
+#endif
     }
 
     return 0;
@@ -181,9 +703,16 @@ int server(void)
     int sockfd;
     struct sockaddr_in servaddr, cliaddr;
 
+    // Every seat keeps its recording open, that goes past the default limit with enough matches
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
     sockfd = socket(AF_INET, SOCK_DGRAM, 0);
     if (sockfd < 0) {
-        perror("socket");
+        LOG_ERROR("socket: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
@@ -193,10 +722,14 @@ int server(void)
     servaddr.sin_port = htons(PORT);
 
     if (bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-        perror("bind");
+        LOG_ERROR("bind: %s", strerror(errno));
         exit(EXIT_FAILURE);
     }
 
+    // Don't block forever when nobody talks, peers still have to time out
+    struct timeval timeout = { .tv_sec = PEER_SWEEP_MS / 1000, .tv_usec = (PEER_SWEEP_MS % 1000) * 1000 };
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
     struct server_data svdata = (struct server_data) {
         .cliaddr = cliaddr,
         .servaddr = servaddr,
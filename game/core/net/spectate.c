@@ -0,0 +1,334 @@
+/**
+ * @file        spectate.c
+ * @brief       Match broadcasting to spectators
+ */
+
+// sendmmsg
+#define _GNU_SOURCE
+
+#include "spectate.h"
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#define FRAME_INDEX(frame) ((frame) & (SPECTATE_HISTORY - 1))
+
+// Frames aren't aligned to anything, so the delta is just runs of bytes kept from the baseline
+// and runs of new bytes: varint size, then (varint copy, varint literal, literal bytes) pairs
+static int delta_encode(buffer_t* out, const encoded_frame_t* base, const encoded_frame_t* target) {
+
+    const uint8_t* b = base ? base->data : NULL;
+    size_t base_size = base ? base->size : 0;
+    const uint8_t* t = target->data;
+    size_t size = target->size;
+
+    if (write_varint(out, (uint32_t) size)) return 1;
+
+    size_t i = 0;
+    while (i < size) {
+
+        size_t copy = i;
+        while (copy < size && copy < base_size && b[copy] == t[copy])
+            copy++;
+
+        // A single matching byte isn't worth breaking the literal for
+        size_t literal = copy;
+        while (literal < size) {
+            if (literal + 1 < size && literal + 1 < base_size &&
+                b[literal] == t[literal] && b[literal + 1] == t[literal + 1])
+                break;
+            literal++;
+        }
+
+        if (write_varint(out, (uint32_t) (copy - i)) ||
+            write_varint(out, (uint32_t) (literal - copy)) ||
+            write_bytes(out, t + copy, literal - copy))
+            return 1;
+
+        i = literal;
+    }
+
+    return 0;
+}
+
+static int delta_decode(reader_t* r, const encoded_frame_t* base, encoded_frame_t* target) {
+
+    const uint8_t* b = base ? base->data : NULL;
+    size_t base_size = base ? base->size : 0;
+
+    uint32_t size;
+    if (read_varint(r, &size) || size > SPECTATE_FRAME_SIZE) return 1;
+
+    size_t i = 0;
+    while (i < size) {
+
+        uint32_t copy, literal;
+        if (read_varint(r, &copy) || read_varint(r, &literal)) return 1;
+        if (!copy && !literal) return 1;
+        if (i + copy > size || i + copy > base_size) return 1;
+
+        memcpy(target->data + i, b + i, copy);
+        i += copy;
+
+        if (i + literal > size) return 1;
+        if (read_bytes(r, target->data + i, literal)) return 1;
+        i += literal;
+    }
+
+    target->size = (uint16_t) size;
+    return 0;
+}
+
+// A bit per board that's in use, then each of their snapshots
+static int encode_lobby(encoded_frame_t* out, const lobby_t* lobby) {
+
+    buffer_t buffer = {
+        .data = out->data,
+        .capacity = sizeof(out->data),
+        .size = 0,
+    };
+
+    uint8_t present = 0;
+    for (int i = 0; i < SPECTATE_BOARDS; i++)
+        if (lobby->players[i].game.name)
+            present |= 1 << i;
+
+    if (write_bytes(&buffer, &present, sizeof(present))) return 1;
+
+    for (int i = 0; i < SPECTATE_BOARDS; i++) {
+        if (!(present & (1 << i)))
+            continue;
+
+        tetris_snapshot snapshot;
+        tetris_save_snapshot(&lobby->players[i].game, &snapshot);
+        if (serialize_snapshot(&buffer, &snapshot)) return 1;
+    }
+
+    out->size = (uint16_t) buffer.size;
+    return 0;
+}
+
+// Frame we still have to delta against, NULL if it's gone or was never there
+static const encoded_frame_t* find_frame(const encoded_frame_t* history, uint32_t latest, uint32_t frame) {
+
+    if (!frame || latest - frame >= SPECTATE_HISTORY)
+        return NULL;
+
+    const encoded_frame_t* f = &history[FRAME_INDEX(frame)];
+    return f->frame == frame ? f : NULL;
+}
+
+// The frame as a datagram against the given baseline, returns its size or 0 if it doesn't fit
+static uint16_t encode_datagram(uint8_t* out, const encoded_frame_t* base, const encoded_frame_t* frame) {
+
+    uint8_t data[MAX_PACKET_SIZE];
+    buffer_t delta = {
+        .data = data,
+        .capacity = sizeof(data),
+        .size = 0,
+    };
+
+    if (delta_encode(&delta, base, frame))
+        return 0;
+
+    packet_types_t packet = {
+        .type = PACKET_TYPE_SPECTATE_FRAME,
+        .spectate_frame = {
+            .frame = frame->frame,
+            .baseline = base ? base->frame : 0,
+            .delta = { .data = delta.data, .size = (uint16_t) delta.size },
+        },
+    };
+
+    buffer_t buffer = {
+        .data = out,
+        .capacity = MAX_PACKET_SIZE,
+        .size = 0,
+    };
+
+    if (serialize_packet(&buffer, &packet))
+        return 0;
+
+    return (uint16_t) buffer.size;
+}
+
+void spectate_server_init(spectate_server_t* s, int sockfd) {
+    memset(s, 0, sizeof(*s));
+    s->sockfd = sockfd;
+}
+
+static int same_addr(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+    return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+void spectate_on_request(spectate_server_t* s, const struct sockaddr_in* addr, uint32_t ack, uint32_t now) {
+
+    spectator_t* spectator = NULL;
+    spectator_t* free_slot = NULL;
+    for (int i = 0; i < MAX_SPECTATORS; i++) {
+        if (s->spectators[i].used && same_addr(&s->spectators[i].addr, addr)) {
+            spectator = &s->spectators[i];
+            break;
+        }
+        if (!s->spectators[i].used && !free_slot)
+            free_slot = &s->spectators[i];
+    }
+
+    if (!spectator) {
+        if (!free_slot) return;
+
+        spectator = free_slot;
+        spectator->used = 1;
+        spectator->addr = *addr;
+        spectator->baseline = 0;
+    }
+
+    spectator->last_seen = now;
+
+    // Acks only move forward, and only to frames we can still delta against
+    if (ack) {
+        if ((int32_t) (ack - spectator->baseline) > 0 && find_frame(s->history, s->frame, ack))
+            spectator->baseline = ack;
+        return;
+    }
+
+    // New, or lost track of everything, start them at the latest keyframe
+    spectator->baseline = 0;
+    if (s->keyframe_size) {
+        sendto(s->sockfd, s->keyframe_packet, s->keyframe_size, 0, (const struct sockaddr*) addr, sizeof(*addr));
+        s->sends++;
+    }
+}
+
+void spectate_broadcast(spectate_server_t* s, const lobby_t* lobby, uint32_t now) {
+
+    uint32_t frame = s->frame + 1;
+    encoded_frame_t* current = &s->history[FRAME_INDEX(frame)];
+    if (encode_lobby(current, lobby))
+        return;
+
+    current->frame = frame;
+    s->frame = frame;
+
+    // Built lazily, only for baselines someone is actually on
+    struct iovec iov[SPECTATE_HISTORY + 1];
+    char built[SPECTATE_HISTORY + 1] = {0};
+
+    static struct mmsghdr messages[MAX_SPECTATORS];
+    unsigned int count = 0;
+
+    for (int i = 0; i < MAX_SPECTATORS; i++) {
+
+        spectator_t* spectator = &s->spectators[i];
+        if (!spectator->used)
+            continue;
+
+        if (now - spectator->last_seen > SPECTATE_TIMEOUT_MS) {
+            spectator->used = 0;
+            continue;
+        }
+
+        const encoded_frame_t* base = find_frame(s->history, frame, spectator->baseline);
+        int slot = base ? FRAME_INDEX(base->frame) : SPECTATE_HISTORY;
+
+        if (!built[slot]) {
+            iov[slot].iov_base = s->datagrams[slot];
+            iov[slot].iov_len = encode_datagram(s->datagrams[slot], base, current);
+            built[slot] = 1;
+            s->encodes++;
+        }
+
+        if (!iov[slot].iov_len)
+            continue;
+
+        messages[count].msg_hdr = (struct msghdr) {
+            .msg_name = &spectator->addr,
+            .msg_namelen = sizeof(spectator->addr),
+            .msg_iov = &iov[slot],
+            .msg_iovlen = 1,
+        };
+        count++;
+    }
+
+    unsigned int sent = 0;
+    while (sent < count) {
+        int n = sendmmsg(s->sockfd, messages + sent, count - sent, 0);
+        if (n <= 0) break;
+        sent += n;
+    }
+    s->sends += sent;
+
+    // Keep the full frame around for whoever joins next
+    if (frame == 1 || frame - s->keyframe >= SPECTATE_KEYFRAME_INTERVAL) {
+
+        int slot = SPECTATE_HISTORY;
+        if (built[slot] && iov[slot].iov_len) {
+            memcpy(s->keyframe_packet, s->datagrams[slot], iov[slot].iov_len);
+            s->keyframe_size = (uint16_t) iov[slot].iov_len;
+        } else {
+            s->keyframe_size = encode_datagram(s->keyframe_packet, NULL, current);
+            s->encodes++;
+        }
+
+        s->keyframe = frame;
+    }
+}
+
+void spectate_client_init(spectate_client_t* c) {
+    memset(c, 0, sizeof(*c));
+}
+
+int spectate_client_on_frame(spectate_client_t* c, const spectate_frame_t* packet) {
+
+    // Old news
+    if (c->frame && (int32_t) (packet->frame - c->frame) <= 0)
+        return 1;
+
+    const encoded_frame_t* base = NULL;
+    if (packet->baseline) {
+        if (packet->frame - packet->baseline >= SPECTATE_HISTORY)
+            return 1;
+
+        base = find_frame(c->history, c->frame, packet->baseline);
+        if (!base)
+            return 1;
+    }
+
+    reader_t delta = {
+        .data = (uint8_t*) packet->delta.data,
+        .size = packet->delta.size,
+        .pos = 0,
+    };
+
+    // Decode on the side, a bad frame shouldn't cost us the slot
+    encoded_frame_t decoded;
+    if (delta_decode(&delta, base, &decoded))
+        return 1;
+
+    reader_t reader = {
+        .data = decoded.data,
+        .size = decoded.size,
+        .pos = 0,
+    };
+
+    uint8_t present;
+    tetris_snapshot boards[SPECTATE_BOARDS];
+    if (read_bytes(&reader, &present, sizeof(present)))
+        return 1;
+
+    for (int i = 0; i < SPECTATE_BOARDS; i++)
+        if ((present & (1 << i)) && deserialize_snapshot(&reader, &boards[i]))
+            return 1;
+
+    for (int i = 0; i < SPECTATE_BOARDS; i++)
+        if (present & (1 << i))
+            c->boards[i] = boards[i];
+
+    decoded.frame = packet->frame;
+    c->history[FRAME_INDEX(packet->frame)] = decoded;
+    c->present = present;
+    c->frame = packet->frame;
+
+    return 0;
+}
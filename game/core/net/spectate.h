@@ -0,0 +1,91 @@
+/**
+ * @file        spectate.h
+ * @brief       Match broadcasting to spectators
+ */
+
+#ifndef SPECTATE_H
+#define SPECTATE_H
+
+#include "packets.h"
+#include "lobby.h"
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+/**
+ * Every time the match changes the server takes a frame, both boards encoded once into bytes.
+ * Spectators ack the frames they get and the next one goes to them as a delta against the
+ * last one they acked. Everyone on the same baseline gets the exact same datagram, so it's
+ * encoded once per baseline, and the whole fan-out is a single sendmmsg with every message
+ * pointing at those shared buffers.
+ *
+ * Every SPECTATE_KEYFRAME_INTERVAL frames the full frame is kept as a ready to send datagram,
+ * anyone joining gets that one right away instead of waiting for the match to move.
+ */
+#define MAX_SPECTATORS 256
+#define SPECTATE_HISTORY 32 // Frames kept to delta against, power of two
+#define SPECTATE_KEYFRAME_INTERVAL 30
+#define SPECTATE_TIMEOUT_MS 5000
+#define SPECTATE_REQUEST_MS 1000 // Spectators re-ack this often, keeps them alive when nothing moves
+
+#define SPECTATE_BOARDS 2
+#define SPECTATE_FRAME_SIZE 512
+
+typedef struct {
+    uint32_t frame;
+    uint16_t size;
+    uint8_t data[SPECTATE_FRAME_SIZE];
+} encoded_frame_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    uint32_t baseline; // Latest frame they acked, 0 for none
+    uint32_t last_seen;
+    char used;
+} spectator_t;
+
+typedef struct {
+    int sockfd;
+    spectator_t spectators[MAX_SPECTATORS];
+
+    uint32_t frame; // Latest one taken, they start at 1
+    encoded_frame_t history[SPECTATE_HISTORY];
+
+    // Latest keyframe, as a datagram
+    uint32_t keyframe;
+    uint8_t keyframe_packet[MAX_PACKET_SIZE];
+    uint16_t keyframe_size;
+
+    // Per baseline datagrams for the frame being sent, the last slot is the one from nothing
+    uint8_t datagrams[SPECTATE_HISTORY + 1][MAX_PACKET_SIZE];
+
+    // Stats
+    unsigned int encodes; // Datagrams encoded
+    unsigned int sends; // Datagrams sent
+} spectate_server_t;
+
+void spectate_server_init(spectate_server_t* s, int sockfd);
+
+// A spectator joined (ack 0) or told us what they have
+void spectate_on_request(spectate_server_t* s, const struct sockaddr_in* addr, uint32_t ack, uint32_t now);
+
+// Take a frame of the lobby and send it to everyone watching
+void spectate_broadcast(spectate_server_t* s, const lobby_t* lobby, uint32_t now);
+
+// Watching side
+typedef struct spectate_client {
+    encoded_frame_t history[SPECTATE_HISTORY];
+    uint32_t frame; // Latest decoded, 0 for none
+    uint32_t last_request;
+
+    uint8_t present; // Bit per board that has someone playing
+    tetris_snapshot boards[SPECTATE_BOARDS];
+} spectate_client_t;
+
+void spectate_client_init(spectate_client_t* c);
+
+// Returns non zero if nothing new came out of it, stale, malformed or against a baseline we lost
+// Either way c->frame is what should be acked back
+int spectate_client_on_frame(spectate_client_t* c, const spectate_frame_t* packet);
+
+#endif
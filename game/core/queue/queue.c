@@ -4,7 +4,7 @@
  */
 
 #include "queue.h"
-#include <stdio.h>
+#include "../log.h"
 
 void queue_init(queue *q) {
 
@@ -23,7 +23,7 @@ char is_full(queue *q) {
 char enqueue(queue* q, int value) {
     
     if (is_full(q)) {
-        fprintf(stderr, "Queue %p is full, cannot enqueue value %d\n", q, value);
+        LOG_WARN("Queue %p is full, cannot enqueue value %d", (void*) q, value);
         return 0;
     }
 
@@ -35,7 +35,7 @@ char enqueue(queue* q, int value) {
 
 char dequeue(queue* q, int* value) {
     if (is_empty(q)) {
-        fprintf(stderr, "Queue %p is empty, cannot dequeue value\n", q);
+        LOG_WARN("Queue %p is empty, cannot dequeue value", (void*) q);
         return 0;
     }
 
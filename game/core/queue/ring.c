@@ -0,0 +1,100 @@
+/**
+ * @file        ring.c
+ * @brief       Lock-free input rings for handing inputs between threads
+ */
+
+#include "ring.h"
+
+#define RING_MASK (INPUT_RING_SIZE - 1)
+
+void spsc_init(spsc_ring* r) {
+    atomic_store_explicit(&r->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, 0, memory_order_relaxed);
+    r->cached_head = 0;
+    r->cached_tail = 0;
+}
+
+char spsc_push(spsc_ring* r, input_record record) {
+
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    if (tail - r->cached_head == INPUT_RING_SIZE) {
+        r->cached_head = atomic_load_explicit(&r->head, memory_order_acquire);
+        if (tail - r->cached_head == INPUT_RING_SIZE)
+            return 0;
+    }
+
+    r->records[tail & RING_MASK] = record;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+char spsc_pop(spsc_ring* r, input_record* out) {
+
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    if (head == r->cached_tail) {
+        r->cached_tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        if (head == r->cached_tail)
+            return 0;
+    }
+
+    *out = r->records[head & RING_MASK];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return 1;
+}
+
+void mpsc_init(mpsc_ring* r) {
+
+    for (uint32_t i = 0; i < INPUT_RING_SIZE; i++)
+        atomic_store_explicit(&r->slots[i].seq, i, memory_order_relaxed);
+
+    atomic_store_explicit(&r->tail, 0, memory_order_relaxed);
+    r->head = 0;
+}
+
+char mpsc_push(mpsc_ring* r, input_record record) {
+
+    uint32_t pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    mpsc_slot* slot;
+
+    for (;;) {
+        slot = &r->slots[pos & RING_MASK];
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t diff = (int32_t) (seq - pos);
+
+        // Free, try to claim it, on failure pos holds the new tail
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed))
+                break;
+        }
+        // Still holds a record from a lap ago, full
+        else if (diff < 0) {
+            return 0;
+        }
+        // Someone else got it first
+        else {
+            pos = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+
+    slot->record = record;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return 1;
+}
+
+char mpsc_pop(mpsc_ring* r, input_record* out) {
+
+    mpsc_slot* slot = &r->slots[r->head & RING_MASK];
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    // Not published yet
+    if ((int32_t) (seq - (r->head + 1)) < 0)
+        return 0;
+
+    *out = slot->record;
+
+    // Free for the producers, one lap ahead
+    atomic_store_explicit(&slot->seq, r->head + INPUT_RING_SIZE, memory_order_release);
+    r->head++;
+    return 1;
+}
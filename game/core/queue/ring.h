@@ -0,0 +1,80 @@
+/**
+ * @file        ring.h
+ * @brief       Lock-free input rings for handing inputs between threads
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define INPUT_RING_SIZE 64 // Power of two
+#define CACHE_LINE 64
+
+typedef enum {
+    INPUT_SOURCE_LOCAL, // Registered by a provider on this machine
+    INPUT_SOURCE_REMOTE, // Came in over the network
+    INPUT_SOURCE_REPLAY
+} input_source;
+
+// An input and when it happened, packed in 8 bytes so a whole ring stays in cache
+// Tick is on whatever clock the producers of a ring share, seq is each producer's own numbering
+typedef struct {
+    uint32_t tick;
+    uint16_t seq;
+    uint8_t action;
+    uint8_t source;
+} input_record;
+
+_Static_assert(sizeof(input_record) == 8, "input_record should pack into 8 bytes");
+
+/**
+ * Single producer, single consumer. Head is only written by the consumer and tail only
+ * by the producer, each on its own cache line so they don't fight over it, and each side
+ * keeps a stale copy of the other's index so it only touches the shared one when it
+ * looks full (or empty).
+ *
+ * Neither side ever blocks or logs, a full ring just says no.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint32_t head;
+    uint32_t cached_tail; // Consumer's view of tail
+
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail;
+    uint32_t cached_head; // Producer's view of head
+
+    _Alignas(CACHE_LINE) input_record records[INPUT_RING_SIZE];
+} spsc_ring;
+
+void spsc_init(spsc_ring* r);
+
+// Return 0 if full
+char spsc_push(spsc_ring* r, input_record record);
+// Return 0 if empty
+char spsc_pop(spsc_ring* r, input_record* out);
+
+/**
+ * Multiple producers, single consumer, bounded like the one above (Vyukov's).
+ * Producers claim a slot by bumping tail, then publish it through the slot's sequence
+ * number, so the consumer never sees a half written record.
+ */
+typedef struct {
+    _Atomic uint32_t seq;
+    input_record record;
+} mpsc_slot;
+
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail; // Shared by producers
+    _Alignas(CACHE_LINE) uint32_t head; // Consumer only
+    _Alignas(CACHE_LINE) mpsc_slot slots[INPUT_RING_SIZE];
+} mpsc_ring;
+
+void mpsc_init(mpsc_ring* r);
+
+// Return 0 if full
+char mpsc_push(mpsc_ring* r, input_record record);
+// Return 0 if empty, consumer thread only
+char mpsc_pop(mpsc_ring* r, input_record* out);
+
+#endif
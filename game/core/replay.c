@@ -0,0 +1,441 @@
+/**
+ * @file        replay.c
+ * @brief       Replay recording and playback
+ */
+
+#include "replay.h"
+#include "log.h"
+#include "net/packets.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void replay_setup_board(tetris_board* game, const replay_settings* settings, char* name) {
+
+    tetris_init(game, settings->rows, settings->cols, settings->seed, name);
+    game->settings.preview_count = settings->preview_count;
+
+    if (settings->start_level)
+        tetris_goto_level(game, settings->start_level);
+
+    if (settings->garbage_lines) {
+        rng_table garbage;
+        rng_init(&garbage, settings->garbage_seed);
+        add_garbage(game, settings->garbage_lines, &garbage);
+    }
+}
+
+static int write_settings(buffer_t* b, const replay_settings* s) {
+    return write_varint(b, s->seed) ||
+           write_varint(b, s->rows) ||
+           write_varint(b, s->cols) ||
+           write_varint(b, s->preview_count) ||
+           write_varint(b, s->start_level) ||
+           write_varint(b, s->garbage_lines) ||
+           write_varint(b, s->garbage_seed);
+}
+
+static int read_settings(reader_t* r, replay_settings* s) {
+
+    uint32_t rows, cols, preview_count, garbage_lines;
+    if (read_varint(r, &s->seed) ||
+        read_varint(r, &rows) ||
+        read_varint(r, &cols) ||
+        read_varint(r, &preview_count) ||
+        read_varint(r, &s->start_level) ||
+        read_varint(r, &garbage_lines) ||
+        read_varint(r, &s->garbage_seed))
+        return 1;
+
+    // Has to fit a board, anything else was never recorded by us
+    if (!rows || !cols || rows > ROWS || cols > COLS || garbage_lines >= rows)
+        return 1;
+
+    s->rows = (uint8_t) rows;
+    s->cols = (uint8_t) cols;
+    s->preview_count = (uint8_t) preview_count;
+    s->garbage_lines = (uint8_t) garbage_lines;
+    return 0;
+}
+
+// Push out what's buffered, a failed write ends the recording
+static void flush_chunk(replay_recorder* r) {
+
+    if (r->file && r->chunk.size && fwrite(r->chunk.data, 1, r->chunk.size, r->file) != r->chunk.size) {
+        LOG_WARN("Replay write failed, recording stopped");
+        fclose(r->file);
+        r->file = NULL;
+    }
+
+    r->written += r->chunk.size;
+    r->chunk.size = 0;
+}
+
+// Make room for n more bytes in the chunk
+static void reserve_chunk(replay_recorder* r, size_t n) {
+    if (r->chunk.size + n > r->chunk.capacity)
+        flush_chunk(r);
+}
+
+static void write_input(replay_recorder* r, uint32_t tick, uint8_t action) {
+
+    reserve_chunk(r, MAX_VARINT_SIZE);
+    put_varint(&r->chunk, ((tick - r->last_tick) << REPLAY_ACTION_BITS) | action);
+    r->last_tick = tick;
+}
+
+static void write_keyframe(replay_recorder* r, const tetris_board* game, uint32_t tick) {
+
+    if (r->keyframe_count == r->keyframe_capacity) {
+        uint32_t capacity = r->keyframe_capacity ? r->keyframe_capacity * 2 : 64;
+        replay_keyframe* keyframes = realloc(r->keyframes, capacity * sizeof(replay_keyframe));
+        if (!keyframes)
+            return;
+
+        r->keyframes = keyframes;
+        r->keyframe_capacity = capacity;
+    }
+
+    tetris_snapshot snapshot;
+    tetris_save_snapshot(game, &snapshot);
+    size_t size = snapshot_size(&snapshot);
+
+    write_input(r, tick, REPLAY_KEYFRAME);
+
+    // Offset of the size, where seeking starts reading
+    reserve_chunk(r, MAX_VARINT_SIZE + size);
+    r->keyframes[r->keyframe_count++] = (replay_keyframe) {
+        .tick = tick,
+        .offset = r->written + (uint32_t) r->chunk.size,
+    };
+
+    put_varint(&r->chunk, (uint32_t) size);
+    serialize_snapshot(&r->chunk, &snapshot);
+}
+
+int replay_record_start(replay_recorder* r, const char* path, const replay_settings* settings, uint32_t start_time) {
+
+    memset(r, 0, sizeof(*r));
+    r->chunk = (buffer_t) {
+        .data = r->chunk_data,
+        .capacity = sizeof(r->chunk_data),
+        .size = 0,
+    };
+
+    r->file = fopen(path, "wb");
+    if (!r->file) {
+        LOG_WARN("Can't record replay to %s", path);
+        return 1;
+    }
+
+    uint8_t version = REPLAY_VERSION;
+    write_bytes(&r->chunk, REPLAY_MAGIC, 4);
+    write_bytes(&r->chunk, &version, 1);
+    write_settings(&r->chunk, settings);
+
+    r->start_time = start_time;
+    return 0;
+}
+
+void replay_record_input(replay_recorder* r, const tetris_board* game, input_event_type action, uint32_t time) {
+
+    if (!r->file)
+        return;
+
+    // Applied in tick order, but a batch can come in stamped before the last one went
+    uint32_t tick = time - r->start_time;
+    if ((int32_t) (tick - r->last_tick) < 0)
+        tick = r->last_tick;
+    write_input(r, tick, (uint8_t) action);
+    r->inputs++;
+
+    uint32_t last = r->keyframe_count ? r->keyframes[r->keyframe_count - 1].tick : 0;
+    if (tick - last >= REPLAY_KEYFRAME_INTERVAL)
+        write_keyframe(r, game, tick);
+}
+
+// End marker, index and footer, then close
+static void write_index(replay_recorder* r) {
+
+    write_input(r, r->last_tick, REPLAY_END);
+
+    uint32_t index = r->written + (uint32_t) r->chunk.size;
+
+    reserve_chunk(r, MAX_VARINT_SIZE);
+    put_varint(&r->chunk, r->keyframe_count);
+
+    for (uint32_t i = 0; i < r->keyframe_count; i++) {
+        reserve_chunk(r, 2 * MAX_VARINT_SIZE);
+        put_varint(&r->chunk, r->keyframes[i].tick);
+        put_varint(&r->chunk, r->keyframes[i].offset);
+    }
+
+    reserve_chunk(r, REPLAY_FOOTER_SIZE);
+    write_u32(&r->chunk, index);
+    write_bytes(&r->chunk, REPLAY_INDEX_MAGIC, 4);
+    flush_chunk(r);
+
+    if (r->file) {
+        fclose(r->file);
+        r->file = NULL;
+    }
+}
+
+void replay_record_finish(replay_recorder* r) {
+
+    if (r->file)
+        write_index(r);
+
+    free(r->keyframes);
+    r->keyframes = NULL;
+    r->keyframe_count = r->keyframe_capacity = 0;
+}
+
+// Read the next input, finished if there's none or the stream is broken
+static void read_next(replay_player* p) {
+
+    for (;;) {
+        uint32_t value;
+        if (read_varint(&p->reader, &value)) {
+            p->finished = 1;
+            return;
+        }
+
+        // The end marker still carries its ticks, next_tick is then how long the game was
+        p->next_tick += value >> REPLAY_ACTION_BITS;
+        p->next_action = value & REPLAY_END;
+        if (p->next_action != REPLAY_KEYFRAME)
+            break;
+
+        // Playing straight through, the board is already there
+        uint32_t size;
+        if (read_varint(&p->reader, &size) || p->reader.pos + size > p->reader.size) {
+            p->finished = 1;
+            return;
+        }
+        p->reader.pos += size;
+    }
+
+    p->finished = p->next_action == REPLAY_END;
+}
+
+// Keyframes from the footer, a replay without a usable one just can't seek fast
+static void read_index(replay_player* p, size_t size) {
+
+    if (size < p->inputs_start + REPLAY_FOOTER_SIZE ||
+        memcmp(p->data + size - 4, REPLAY_INDEX_MAGIC, 4))
+        return;
+
+    reader_t footer = {
+        .data = p->data,
+        .size = size,
+        .pos = size - REPLAY_FOOTER_SIZE,
+    };
+
+    uint32_t index;
+    read_u32(&footer, &index);
+    if (index < p->inputs_start || index > size - REPLAY_FOOTER_SIZE)
+        return;
+
+    reader_t r = {
+        .data = p->data,
+        .size = size - REPLAY_FOOTER_SIZE,
+        .pos = index,
+    };
+
+    // Every entry takes at least two bytes
+    uint32_t count;
+    if (read_varint(&r, &count) || count > (r.size - r.pos) / 2)
+        return;
+
+    replay_keyframe* keyframes = count ? malloc(count * sizeof(replay_keyframe)) : NULL;
+    if (count && !keyframes)
+        return;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (read_varint(&r, &keyframes[i].tick) || read_varint(&r, &keyframes[i].offset) ||
+            keyframes[i].offset < p->inputs_start || keyframes[i].offset >= index ||
+            (i && keyframes[i].tick < keyframes[i - 1].tick)) {
+            free(keyframes);
+            return;
+        }
+    }
+
+    p->keyframes = keyframes;
+    p->keyframe_count = count;
+    p->inputs_end = index;
+}
+
+int replay_open(replay_player* p, const uint8_t* data, size_t size) {
+
+    memset(p, 0, sizeof(*p));
+    p->data = (uint8_t*) data;
+    p->reader = (reader_t) {
+        .data = p->data,
+        .size = size,
+        .pos = 0,
+    };
+
+    char magic[4];
+    uint8_t version;
+    if (read_bytes(&p->reader, magic, 4) || memcmp(magic, REPLAY_MAGIC, 4) ||
+        read_bytes(&p->reader, &version, 1) || !version || version > REPLAY_VERSION ||
+        read_settings(&p->reader, &p->settings))
+        return 1;
+
+    p->inputs_start = (uint32_t) p->reader.pos;
+    p->inputs_end = (uint32_t) size;
+
+    p->tick_rate = version >= 3 ? REPLAY_TICK_RATE : REPLAY_LEGACY_TICK_RATE;
+
+    // Version 1 had no keyframes
+    if (version >= 2)
+        read_index(p, size);
+
+    p->reader.size = p->inputs_end;
+    return 0;
+}
+
+int replay_load(replay_player* p, const char* path) {
+
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return 1;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* data = size > 0 ? malloc(size) : NULL;
+    if (!data || fread(data, 1, size, f) != (size_t) size) {
+        free(data);
+        fclose(f);
+        return 1;
+    }
+    fclose(f);
+
+    if (replay_open(p, data, size)) {
+        free(data);
+        return 1;
+    }
+
+    p->owned = 1;
+    return 0;
+}
+
+void replay_close(replay_player* p) {
+
+    if (p->owned)
+        free(p->data);
+
+    free(p->keyframes);
+    p->keyframes = NULL;
+    p->keyframe_count = 0;
+
+    p->data = NULL;
+    p->owned = 0;
+}
+
+void replay_start(replay_player* p, tetris_board* game, char* name) {
+
+    replay_setup_board(game, &p->settings, name);
+
+    p->reader.pos = p->inputs_start;
+    p->tick = 0;
+    p->next_tick = 0;
+    p->finished = 0;
+    p->clock.remainder = 0;
+    read_next(p);
+}
+
+void replay_step_to(replay_player* p, tetris_board* game, uint32_t tick) {
+
+    while (!p->finished && p->next_tick <= tick) {
+        tetris_apply_input(game, p->next_action);
+        read_next(p);
+    }
+
+    p->tick = tick;
+}
+
+// From the very beginning, the board gets set up again
+static void restart(replay_player* p, tetris_board* game, uint32_t tick) {
+    tetris_destroy(game);
+    replay_start(p, game, game->name);
+    replay_step_to(p, game, tick);
+}
+
+void replay_seek(replay_player* p, tetris_board* game, uint32_t tick) {
+
+    // Last keyframe at or before the target
+    uint32_t lo = 0, hi = p->keyframe_count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (p->keyframes[mid].tick <= tick) lo = mid + 1;
+        else hi = mid;
+    }
+
+    // Going forward within the same stretch, carrying on is cheaper
+    uint32_t from = lo ? p->keyframes[lo - 1].tick : 0;
+    if (tick >= p->tick && (p->tick >= from || p->finished)) {
+        replay_step_to(p, game, tick);
+        return;
+    }
+
+    if (!lo) {
+        restart(p, game, tick);
+        return;
+    }
+
+    const replay_keyframe* k = &p->keyframes[lo - 1];
+    p->reader.pos = k->offset;
+
+    uint32_t size;
+    tetris_snapshot snapshot;
+    if (read_varint(&p->reader, &size) || deserialize_snapshot(&p->reader, &snapshot)) {
+        // Broken keyframe, the slow way still works
+        restart(p, game, tick);
+        return;
+    }
+
+    tetris_load_snapshot(game, &snapshot);
+    p->next_tick = k->tick;
+    p->finished = 0;
+    p->clock.remainder = 0;
+    read_next(p);
+    replay_step_to(p, game, tick);
+}
+
+void replay_advance(replay_player* p, tetris_board* game, uint32_t us, uint32_t speed) {
+
+    uint32_t ticks = tick_clock_advance_at(&p->clock, us * speed, p->tick_rate);
+    if (ticks)
+        replay_step_to(p, game, p->tick + ticks);
+}
+
+void replay_scan(replay_player* p, uint32_t* length, uint32_t* inputs) {
+
+    p->reader.pos = p->inputs_start;
+    p->next_tick = 0;
+    p->finished = 0;
+
+    uint32_t count = 0;
+    for (read_next(p); !p->finished; read_next(p))
+        count++;
+
+    *length = (uint32_t) ((uint64_t) p->next_tick * REPLAY_TICK_RATE / p->tick_rate);
+    *inputs = count;
+
+    p->reader.pos = p->inputs_start;
+    p->next_tick = 0;
+    p->finished = 0;
+}
+
+void replay_run(replay_player* p, tetris_board* game) {
+
+    while (!p->finished) {
+        tetris_apply_input(game, p->next_action);
+        p->tick = p->next_tick;
+        read_next(p);
+    }
+}
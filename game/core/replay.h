@@ -0,0 +1,145 @@
+/**
+ * @file        replay.h
+ * @brief       Replay recording and playback
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "tetris.h"
+#include "net/buffer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * The engine is deterministic and gravity goes through the input queue like everything
+ * else, so a game is fully described by how the board was set up and the inputs it
+ * applied, in order. That's all a replay is:
+ *
+ *  - "NTRP", a version byte, then the settings as varints
+ *  - one varint per applied input, (ticks since the last one << 4) | action
+ *  - a REPLAY_END "input" with the ticks up to the last one
+ *
+ * Ticks are the times the board stamped its inputs with (input_record), milliseconds, only
+ * there to play it back at the speed it was played, they don't change what happens. Version
+ * 2 and older counted ticks on a 60 Hz clock of their own. Inputs come in bursts, a varint of
+ * 1-2 bytes each, a whole game is a few KB.
+ *
+ * Every REPLAY_KEYFRAME_INTERVAL ticks a REPLAY_KEYFRAME "input" carries the board as it
+ * is right then (varint size + snapshot). After the end marker an index of them follows:
+ * varint count, then (varint tick, varint offset of the size) per keyframe, and the last
+ * REPLAY_FOOTER_SIZE bytes are the index offset and "NTRI" so it can be found from the end.
+ * Seeking loads the closest keyframe before the target and only replays from there.
+ */
+#define REPLAY_MAGIC "NTRP"
+#define REPLAY_INDEX_MAGIC "NTRI"
+#define REPLAY_VERSION 3
+
+#define REPLAY_TICK_RATE 1000
+#define REPLAY_LEGACY_TICK_RATE 60 // Version 2 and older
+#define REPLAY_ACTION_BITS 4
+#define REPLAY_END ((1 << REPLAY_ACTION_BITS) - 1) // Not input_event_types
+#define REPLAY_KEYFRAME (REPLAY_END - 1)
+
+#define REPLAY_KEYFRAME_INTERVAL (5 * REPLAY_TICK_RATE)
+#define REPLAY_FOOTER_SIZE 8
+
+#define REPLAY_CHUNK_SIZE 1024 // Recorded inputs are written out this many bytes at a time
+
+typedef struct {
+    uint32_t tick;
+    uint32_t offset;
+} replay_keyframe;
+
+// Everything needed to set a board up the same way again
+typedef struct {
+    uint32_t seed;
+    uint8_t rows;
+    uint8_t cols;
+    uint8_t preview_count;
+    uint32_t start_level;
+
+    // Challenge mode starts with garbage, from its own rng
+    uint8_t garbage_lines;
+    uint32_t garbage_seed;
+} replay_settings;
+
+// Start a board from settings, both recording and playback go through here
+void replay_setup_board(tetris_board* game, const replay_settings* settings, char* name);
+
+// Recording, attach to a board with game->recorder and every input it applies gets written
+typedef struct replay_recorder {
+    FILE* file; // NULL once finished or if writing failed
+    uint32_t start_time; // On the clock the board stamps its inputs with
+    uint32_t last_tick;
+    uint32_t inputs;
+
+    uint32_t written; // Bytes flushed to the file so far
+    buffer_t chunk;
+    uint8_t chunk_data[REPLAY_CHUNK_SIZE];
+
+    // Written out as the index once the game is over
+    replay_keyframe* keyframes;
+    uint32_t keyframe_count;
+    uint32_t keyframe_capacity;
+} replay_recorder;
+
+// Returns non zero if the file couldn't be opened
+// `start_time` is when the game starts on the input clock, now_ms() for a local board, 0 for a session
+int replay_record_start(replay_recorder* r, const char* path, const replay_settings* settings, uint32_t start_time);
+// `game` is the board right after applying it, keyframes are taken from it, `time` is the input's tick
+void replay_record_input(replay_recorder* r, const tetris_board* game, input_event_type action, uint32_t time);
+void replay_record_finish(replay_recorder* r);
+
+// Playback, the whole file is small enough to keep in memory
+typedef struct {
+    uint8_t* data; // Owned if loaded from a file
+    char owned;
+    reader_t reader;
+
+    replay_settings settings;
+    uint32_t inputs_start; // Offset of the first input
+    uint32_t inputs_end; // Where the index starts, or the end of the data without one
+
+    // From the index, empty if there was none, seeking then replays from the start
+    replay_keyframe* keyframes;
+    uint32_t keyframe_count;
+
+    uint32_t tick_rate; // Ticks per second, REPLAY_TICK_RATE unless it's an old one
+
+    uint32_t tick; // Everything up to here was applied
+    uint32_t next_tick; // Tick of the next input, once finished the last tick of the game
+    uint8_t next_action;
+    char finished;
+    tick_clock clock;
+} replay_player;
+
+// Returns non zero if the file is missing or isn't a replay
+int replay_load(replay_player* p, const char* path);
+// Same from memory that outlives the player
+int replay_open(replay_player* p, const uint8_t* data, size_t size);
+void replay_close(replay_player* p);
+
+// Set the board up and rewind to the start
+void replay_start(replay_player* p, tetris_board* game, char* name);
+
+// Apply everything up to and including `tick`
+void replay_step_to(replay_player* p, tetris_board* game, uint32_t tick);
+
+// Jump anywhere, backwards included, from the closest keyframe before it
+// At most REPLAY_KEYFRAME_INTERVAL ticks of inputs get replayed
+void replay_seek(replay_player* p, tetris_board* game, uint32_t tick);
+
+// Real time playback, `speed` times as fast as it was played, fast forward is just a bigger one
+void replay_advance(replay_player* p, tetris_board* game, uint32_t us, uint32_t speed);
+
+// Everything to the end, as fast as it goes
+void replay_run(replay_player* p, tetris_board* game);
+
+// Read through to the end without a board, for how long the game was (REPLAY_TICK_RATE ticks)
+// and how many inputs it took
+// Rewinds to the start, replay_start is still needed before playing
+void replay_scan(replay_player* p, uint32_t* length, uint32_t* inputs);
+
+#endif
@@ -0,0 +1,184 @@
+/**
+ * @file        replay_archive.c
+ * @brief       Append-only archive of replays
+ */
+
+#include "replay_archive.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int replay_archive_append(const char* path, const uint8_t* replay, size_t size, uint64_t final_hash) {
+
+    replay_player p;
+    if (replay_open(&p, replay, size))
+        return 1;
+
+    uint32_t length, inputs;
+    uint32_t seed = p.settings.seed;
+    replay_scan(&p, &length, &inputs);
+    replay_close(&p);
+
+    uint8_t header[REPLAY_ARCHIVE_HEADER_SIZE];
+    buffer_t b = {
+        .data = header,
+        .capacity = sizeof(header),
+        .size = 0,
+    };
+
+    write_bytes(&b, REPLAY_ARCHIVE_MAGIC, 4);
+    write_u32(&b, (uint32_t) size);
+    write_u32(&b, seed);
+    write_u32(&b, length);
+    write_u32(&b, inputs);
+    write_u32(&b, 0);
+    write_u32(&b, (uint32_t) (final_hash >> 32));
+    write_u32(&b, (uint32_t) final_hash);
+
+    FILE* f = fopen(path, "ab");
+    if (!f) {
+        LOG_WARN("Can't open replay archive %s", path);
+        return 1;
+    }
+
+    int failed = fwrite(header, 1, sizeof(header), f) != sizeof(header) ||
+                 fwrite(replay, 1, size, f) != size;
+
+    failed |= fclose(f) != 0;
+    if (failed)
+        LOG_WARN("Appending to replay archive %s failed", path);
+
+    return failed;
+}
+
+int replay_archive_append_file(const char* path, const char* replay_path, uint64_t final_hash) {
+
+    FILE* f = fopen(replay_path, "rb");
+    if (!f)
+        return 1;
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* data = size > 0 ? malloc(size) : NULL;
+    int failed = !data || fread(data, 1, size, f) != (size_t) size;
+    fclose(f);
+
+    if (!failed)
+        failed = replay_archive_append(path, data, size, final_hash);
+
+    free(data);
+    return failed;
+}
+
+int replay_archive_open(replay_archive* a, const char* path) {
+
+    memset(a, 0, sizeof(*a));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return 1;
+    }
+
+    void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 1;
+
+    a->data = data;
+    a->size = st.st_size;
+
+    // Walk the headers, counting first so the index is a single allocation
+    reader_t r = {
+        .data = (uint8_t*) a->data,
+        .size = a->size,
+        .pos = 0,
+    };
+
+    for (int pass = 0; pass < 2; pass++) {
+
+        r.pos = 0;
+        a->count = 0;
+
+        while (r.size - r.pos >= REPLAY_ARCHIVE_HEADER_SIZE) {
+
+            if (memcmp(r.data + r.pos, REPLAY_ARCHIVE_MAGIC, 4))
+                break;
+
+            replay_archive_entry e;
+            uint32_t reserved, hash_high, hash_low;
+            r.pos += 4;
+            read_u32(&r, &e.size);
+            read_u32(&r, &e.seed);
+            read_u32(&r, &e.length);
+            read_u32(&r, &e.inputs);
+            read_u32(&r, &reserved);
+            read_u32(&r, &hash_high);
+            read_u32(&r, &hash_low);
+            e.final_hash = ((uint64_t) hash_high << 32) | hash_low;
+            e.offset = r.pos;
+
+            // Cut short, whatever comes after is garbage too
+            if (e.size > r.size - r.pos)
+                break;
+            r.pos += e.size;
+
+            if (pass)
+                a->entries[a->count] = e;
+            a->count++;
+        }
+
+        if (!pass) {
+            a->entries = a->count ? malloc(a->count * sizeof(replay_archive_entry)) : NULL;
+            if (a->count && !a->entries) {
+                replay_archive_close(a);
+                return 1;
+            }
+        }
+    }
+
+    if (r.pos != r.size)
+        LOG_WARN("Replay archive %s has %zu trailing bytes that aren't a replay", path, r.size - r.pos);
+
+    return 0;
+}
+
+void replay_archive_close(replay_archive* a) {
+
+    if (a->data)
+        munmap((void*) a->data, a->size);
+
+    free(a->entries);
+    memset(a, 0, sizeof(*a));
+}
+
+int replay_archive_verify(const replay_archive* a, uint32_t index, uint64_t* final_hash) {
+
+    const replay_archive_entry* e = &a->entries[index];
+
+    replay_player p;
+    if (replay_open(&p, a->data + e->offset, e->size))
+        return 1;
+
+    tetris_board game;
+    replay_start(&p, &game, "verify");
+    replay_run(&p, &game);
+
+    *final_hash = tetris_state_hash(&game);
+
+    tetris_destroy(&game);
+    replay_close(&p);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+ * @file        replay_archive.h
+ * @brief       Append-only archive of replays
+ */
+
+#ifndef REPLAY_ARCHIVE_H
+#define REPLAY_ARCHIVE_H
+
+#include "replay.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * One file, replays appended one after the other, each behind a fixed size header:
+ *
+ *  "NTRA", u32 replay size, u32 seed, u32 length in ticks, u32 inputs, u32 reserved,
+ *  u64 tetris_state_hash of the final board as it was when the game was played
+ *
+ * Big endian like everything on the wire. Nothing is ever rewritten, the headers are the
+ * index, and reading is an mmap and a walk over them. A replay cut short by a crash
+ * mid-append is just left out.
+ *
+ * Verifying an entry plays it back and compares the final state's hash with the stored
+ * one, if they differ the engine stopped being deterministic with what it used to be.
+ */
+#define REPLAY_ARCHIVE_MAGIC "NTRA"
+#define REPLAY_ARCHIVE_HEADER_SIZE 32
+
+typedef struct {
+    size_t offset; // Of the replay itself
+    uint32_t size;
+    uint32_t seed;
+    uint32_t length;
+    uint32_t inputs;
+    uint64_t final_hash;
+} replay_archive_entry;
+
+typedef struct {
+    const uint8_t* data;
+    size_t size;
+
+    replay_archive_entry* entries;
+    uint32_t count;
+} replay_archive;
+
+// Add a finished replay, `final_hash` is tetris_state_hash of the board it was recorded from
+int replay_archive_append(const char* path, const uint8_t* replay, size_t size, uint64_t final_hash);
+int replay_archive_append_file(const char* path, const char* replay_path, uint64_t final_hash);
+
+// Returns non zero if it can't be mapped
+int replay_archive_open(replay_archive* a, const char* path);
+void replay_archive_close(replay_archive* a);
+
+// Play an entry back to the end, returns non zero if it doesn't even parse
+int replay_archive_verify(const replay_archive* a, uint32_t index, uint64_t* final_hash);
+
+#endif
@@ -7,6 +7,10 @@
 #include "input.h"
 #include "rng.h"
 #include "net/client.h"
+#include "net/prediction.h"
+#include "utils.h"
+#include "log.h"
+#include "replay.h"
 
 #include <assert.h>
 #include <math.h>
@@ -55,29 +59,80 @@ position TETROMINOS[NUM_TETROMINOS][NUM_ORIENTATIONS][TETRIS] = {
 // Values from https://listfist.com/list-of-tetris-levels-by-speed-nes-ntsc-vs-pal
 // Keep a constant 20 as the values are pulled from seconds until bottom
 // So regardless of row size we keep the same speed scaling intentionally
-float LEVEL_SPEED[NUM_LEVELS] = {
-    14.398f / 20.0f, // Level 0
-    12.798f / 20.0f, // Level 1
-    11.598f / 20.0f, // Level 2
-    9.999f / 20.0f, // Level 3
-    8.799f / 20.0f, // Level 4
-    7.199f / 20.0f, // Level 5
-    5.999f / 20.0f, // Level 6
-    4.399f / 20.0f, // Level 7
-    2.800f / 20.0f, // Level 8
-    2.000f / 20.0f, // Level 9
-    1.600f / 20.0f, // Level 10
-    1.600f / 20.0f, // Level 11
-    1.600f / 20.0f, // Level 12
-    1.200f / 20.0f, // Level 13
-    1.200f / 20.0f, // Level 14
-    1.200f / 20.0f, // Level 15
-    0.800f / 20.0f, // Level 16
-    0.800f / 20.0f, // Level 17
-    0.800f / 20.0f, // Level 18
-    0.400f / 20.0f, // Level 19
+// They're only seconds in the source, the table is integers by the time it's compiled
+uint32_t LEVEL_GRAVITY[NUM_LEVELS] = {
+    GRAVITY_FROM_SECONDS(14.398 / 20.0), // Level 0
+    GRAVITY_FROM_SECONDS(12.798 / 20.0), // Level 1
+    GRAVITY_FROM_SECONDS(11.598 / 20.0), // Level 2
+    GRAVITY_FROM_SECONDS(9.999 / 20.0), // Level 3
+    GRAVITY_FROM_SECONDS(8.799 / 20.0), // Level 4
+    GRAVITY_FROM_SECONDS(7.199 / 20.0), // Level 5
+    GRAVITY_FROM_SECONDS(5.999 / 20.0), // Level 6
+    GRAVITY_FROM_SECONDS(4.399 / 20.0), // Level 7
+    GRAVITY_FROM_SECONDS(2.800 / 20.0), // Level 8
+    GRAVITY_FROM_SECONDS(2.000 / 20.0), // Level 9
+    GRAVITY_FROM_SECONDS(1.600 / 20.0), // Level 10
+    GRAVITY_FROM_SECONDS(1.600 / 20.0), // Level 11
+    GRAVITY_FROM_SECONDS(1.600 / 20.0), // Level 12
+    GRAVITY_FROM_SECONDS(1.200 / 20.0), // Level 13
+    GRAVITY_FROM_SECONDS(1.200 / 20.0), // Level 14
+    GRAVITY_FROM_SECONDS(1.200 / 20.0), // Level 15
+    GRAVITY_FROM_SECONDS(0.800 / 20.0), // Level 16
+    GRAVITY_FROM_SECONDS(0.800 / 20.0), // Level 17
+    GRAVITY_FROM_SECONDS(0.800 / 20.0), // Level 18
+    GRAVITY_FROM_SECONDS(0.400 / 20.0), // Level 19
+    GRAVITY_G(20), // Level 20, pieces hit the floor the frame they spawn
 };
 
+/**
+ * Zobrist keys, a fixed 64 bit value per (cell, contents), the cell hash is the keys of
+ * every filled cell xor'd together. Changing a cell takes its old key out and puts the
+ * new one in, nothing else gets looked at.
+ *
+ * Keys are splitmix64 of the index, so every build on every machine agrees on them
+ */
+static uint64_t splitmix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static uint64_t cell_key(size_t i, char value) {
+    return splitmix64(((uint64_t) i << 4 | (uint8_t) value) * 0x9e3779b97f4a7c15ull);
+}
+
+/**
+ * @brief Every locked cell change goes through here
+ */
+static void set_cell(tetris_board* game, size_t i, char value) {
+
+    char old = game->board[i];
+    if (old == value) return;
+
+    if (old) game->cells_hash ^= cell_key(i, old);
+    if (value) game->cells_hash ^= cell_key(i, value);
+
+    game->board[i] = value;
+    game->board_version++;
+}
+
+/**
+ * @brief Hash the cells from scratch, for when the whole board was replaced
+ */
+static void rehash_cells(tetris_board* game) {
+
+    uint64_t old = game->cells_hash;
+
+    game->cells_hash = 0;
+    for (size_t i = 0; i < game->rows * game->cols; i++)
+        if (game->board[i])
+            game->cells_hash ^= cell_key(i, game->board[i]);
+
+    // Loading the same cells again (spectating, rolling back) isn't a change
+    if (game->cells_hash != old)
+        game->board_version++;
+}
+
 /**
  * @brief Retrieve piece with RNG
  */
@@ -98,15 +153,15 @@ tetromino_type tetris_peek_next(tetris_board *game, unsigned int n) {
 }
 
 /**
- * @brief Sample speed table based on current level
+ * @brief Sample gravity table based on current level
  */
-float sample_speed_table(tetris_board* game) {
+uint32_t sample_gravity_table(tetris_board* game) {
  
     unsigned int level = game->level;
     if (level >= NUM_LEVELS) // Level cap
         level = NUM_LEVELS - 1;
  
-    return LEVEL_SPEED[level];
+    return LEVEL_GRAVITY[level];
 }
 
 /**
@@ -184,11 +239,8 @@ void clear_board(tetris_board* game) {
 
     assert(game->board != NULL);
 
-    for (size_t x = 0; x < game->rows; x++) {
-        for (size_t y = 0; y < game->cols; y++) {
-            game->board[x * game->cols + y] = 0;
-        }
-    }
+    for (size_t i = 0; i < game->rows * game->cols; i++)
+        set_cell(game, i, 0);
 }
 
 /**
@@ -200,14 +252,14 @@ void clear_row(tetris_board* game, unsigned int row) {
     assert(row >= 0 && row < game->rows);
 
     // Clear the row
-    for (size_t x = 0; x < game->rows; x++) {
-        game->board[x * game->rows + row] = 0;
+    for (size_t x = 0; x < game->cols; x++) {
+        set_cell(game, x * game->rows + row, 0);
     }
 
     // Move all rows above down by one
     for (size_t y = row; y > 0; y--) {
-        for (size_t x = 0; x < game->rows; x++) {
-            game->board[x * game->rows + y] = game->board[x * game->rows + (y - 1)];
+        for (size_t x = 0; x < game->cols; x++) {
+            set_cell(game, x * game->rows + y, game->board[x * game->rows + (y - 1)]);
         }
     }
 }
@@ -218,6 +270,7 @@ void clear_row(tetris_board* game, unsigned int row) {
 void check_for_clears(tetris_board* game) {
 
     int lines_cleared = 0;
+    uint32_t rows = 0;
     for (size_t y = 0; y < game->rows; y++) {
         char full = 1;
 
@@ -231,9 +284,18 @@ void check_for_clears(tetris_board* game) {
         if (full) {
             clear_row(game, y);
             lines_cleared++;
+
+            // Rows above move down, so y is still where this one was
+            if (y < 32)
+                rows |= 1u << y;
         }
     }
 
+    if (lines_cleared) {
+        game->counters.clear_rows = rows;
+        game->counters.clear_tick = game->counters.tick;
+    }
+
     attribute_score(game, lines_cleared);
 }
 
@@ -279,7 +341,7 @@ void lock_piece(tetris_board* game, tetromino* piece) {
         int cell_y = cell_position.y + piece->pos.y;
 
         //game->board[cell_x * game->cols + cell_y] = piece->type + 1;
-        game->board[cell_x * game->rows + cell_y] = piece->type + 1;
+        set_cell(game, cell_x * game->rows + cell_y, piece->type + 1);
     }
 
     check_for_clears(game);
@@ -296,13 +358,13 @@ void push_line_to_bottom(tetris_board* game, char* line) {
     // Move all rows up by one
     for (size_t y = 0; y < game->rows - 1; y++) {
         for (size_t x = 0; x < game->cols; x++) {
-            game->board[x * game->rows + y] = game->board[x * game->rows + (y + 1)];
+            set_cell(game, x * game->rows + y, game->board[x * game->rows + (y + 1)]);
         }
     }
 
     // Insert new line at the bottom
     for (size_t x = 0; x < game->cols; x++) {
-        game->board[x * game->rows + (game->rows - 1)] = line[x];
+        set_cell(game, x * game->rows + (game->rows - 1), line[x]);
     }
 }
 
@@ -346,59 +408,74 @@ void tetris_init(tetris_board* game, int rows, int cols, unsigned int seed, char
     game->level = 1;
 
     game->has_hold = 0;
+    game->has_held = 0;
+    game->hold = (tetromino) {0};
     game->current = get_random_piece(game);
     game->next = get_random_piece(game);
 
     game->lock_grace_counter = 0;
 
-    game->counters.gravity_timer = 0.0f;
-    game->counters.move_timer = 0.0f;
-    game->counters.drop_timer = 0.0f;
-    game->counters.rotations_tried = 0;
-    game->counters.old_rot = 0;
+    game->counters = (tetris_counters) {0};
 
     // Initialize settings
     game->settings.preview_count = 3;
+    game->settings.das = DEFAULT_DAS_TICKS;
+    game->settings.arr = DEFAULT_ARR_TICKS;
 
     // Initialize input queue
-    queue_init(&game->input_queue);
+    mpsc_init(&game->input_queue);
+    game->input_seq = 0;
+    game->recorder = NULL;
+    // A full bucket and a cooldown ago, so the very first input goes through whatever clock is used
     game->validator = (input_validator_t) {
-        .last_move_time = 0,
-        .last_drop_time = 0,
+        .move_tokens = MOVE_BURST,
+        .last_drop_time = 0u - DROP_COOLDOWN_MS,
     };
 
     // Initialize field to empty
     game->board = malloc(rows * cols * sizeof(char*));
     if (game->board == NULL) {
-        fprintf(stderr, "Failed to allocate memory for tetris board\n");
+        LOG_ERROR("Failed to allocate memory for tetris board");
         exit(EXIT_FAILURE);
     }
 
-    clear_board(game);
+    memset(game->board, 0, rows * cols);
+    game->cells_hash = 0;
+    game->board_version = 0;
 
     // Start game with current piece at top
     place_piece_at_top(game, &game->current);
 
     game->server = NULL;
+    memset(&game->net, 0, sizeof(game->net));
 }
 
 void tetris_bind_game(tetris_board* game, udp_client* client) {
 
     if (client) {
-        // Send connect
-        client_send(client, &(packet_types_t) {
+        assert(client->next_player_id < MAX_CLIENT_PLAYERS);
+
+        game->net.player_id = client->next_player_id++;
+        game->net.start_time = now_ms();
+        client->boards[game->net.player_id] = game;
+
+        // Send connect, if it got lost the server would never know about us
+        client_send_reliable(client, &(packet_types_t) {
             .type = PACKET_TYPE_CONNECT,
             .connect = {
-                .username = strdup(game->name),
+                .player = game->net.player_id,
+                .username = game->name,
                 .connect_time = time(NULL),
             }
         });
-    } else {
+    } else if (game->server) {
+        game->server->boards[game->net.player_id] = NULL;
+
         // Send disconnect
-        client_send(client, &(packet_types_t) {
+        client_send_reliable(game->server, &(packet_types_t) {
             .type = PACKET_TYPE_DISCONNECT,
             .disconnect = {
-                .username = strdup(game->name),
+                .player = game->net.player_id,
                 .disconnect_time = time(NULL),
             }
         });
@@ -407,45 +484,133 @@ void tetris_bind_game(tetris_board* game, udp_client* client) {
     game->server = client;
 }
 
-#define MOVE_COOLDOWN 0.08f
-#define DROP_COOLDOWN 0.03f
+void tetris_apply_input(tetris_board* game, input_event_type action) {
+    switch (action) {
+        case IE_MOVE_LEFT:      tetris_move(game, -1);        break;
+        case IE_MOVE_RIGHT:     tetris_move(game, 1);         break;
+        case IE_ROTATE_RIGHT:   tetris_rotate(game, R_RIGHT); break;
+        case IE_ROTATE_LEFT:    tetris_rotate(game, R_LEFT);  break;
+        case IE_DROP:           tetris_drop(game);            break;
+        case IE_GRAVITY:        tetris_apply_gravity(game);   break;
+        case IE_HARD_DROP:      tetris_hard_drop(game);       break;
+        case IE_HOLD:           tetris_hold(game);            break;
+        case IE_RESET:          tetris_reset(game);           break;
+        default:                                              break;
+    }
+}
 
 void tetris_process_input_queue(tetris_board* game) {
-    int action;
-    while (!is_empty(&game->input_queue)) {
-        if (!dequeue(&game->input_queue, &action)) break;
-        switch (action) {
-            case IE_MOVE_LEFT:      tetris_move(game, -1);        break;
-            case IE_MOVE_RIGHT:     tetris_move(game, 1);         break;
-            case IE_ROTATE_RIGHT:   tetris_rotate(game, R_RIGHT); break;
-            case IE_ROTATE_LEFT:    tetris_rotate(game, R_LEFT);  break;
-            case IE_DROP:           tetris_drop(game);            break;
-            case IE_GRAVITY:        tetris_apply_gravity(game);   break;
-            case IE_HARD_DROP:      tetris_hard_drop(game);       break;
-            case IE_HOLD:           tetris_hold(game);            break;
-            case IE_RESET:          tetris_reset(game);           break;
-            default:                                              break;
-        }
+
+    // Producers don't push in lockstep, so take everything there is and go by tick
+    input_record records[INPUT_RING_SIZE];
+    int count = 0;
+    while (count < INPUT_RING_SIZE && mpsc_pop(&game->input_queue, &records[count]))
+        count++;
+
+    // Stable, same tick keeps the order they arrived in
+    for (int i = 1; i < count; i++) {
+        input_record r = records[i];
+        int j = i;
+        for (; j > 0 && (int32_t) (r.tick - records[j - 1].tick) < 0; j--)
+            records[j] = records[j - 1];
+        records[j] = r;
+    }
+
+    for (int i = 0; i < count; i++) {
+        tetris_apply_input(game, records[i].action);
+
+        if (game->recorder)
+            replay_record_input(game->recorder, game, records[i].action, records[i].tick);
+
+        // Remember what we predicted so the server can correct us
+        if (game->server)
+            prediction_record(game);
     }
 }
 
-void tetris_update(tetris_board* game, float dt) {
+/**
+ * @brief Would the current piece land if it fell one more row
+ */
+static char grounded(tetris_board* game) {
+    tetromino probe = game->current;
+    return move_tetromino(game, &probe, 0, 1) != 1;
+}
+
+static char same_pose(const tetromino* a, const tetromino* b) {
+    return a->type == b->type && a->rot == b->rot && a->pos.x == b->pos.x && a->pos.y == b->pos.y;
+}
+
+/**
+ * @brief Gravity goes through the queue like any input, applied right away so the next row sees where it landed
+ */
+static void fall(tetris_board* game) {
+    register_input(IE_GRAVITY, game);
+    tetris_process_input_queue(game);
+}
+
+/**
+ * @brief One tick of the clock, gravity while the piece is in the air, lock delay once it's down
+ *
+ * Nothing here touches the board directly, it only decides when gravity happens. Whoever
+ * applies the inputs (the server, a replay) gets the exact same game without ever ticking
+ */
+static void tetris_tick(tetris_board* game) {
+
+    tetris_counters* c = &game->counters;
+    c->tick++;
 
-    // If game over, nothing to do
-    if (game->game_over) return;
+    if (grounded(game)) {
+        c->gravity = 0;
 
-    float speed = sample_speed_table(game);
-    if (game->counters.gravity_timer > speed) {
+        // Moving or rotating it buys more time, up to a point
+        if (!same_pose(&c->lock_pose, &game->current) && game->lock_grace_counter <= LOCK_MAX_RESETS)
+            c->lock_ticks = 0;
+        c->lock_pose = game->current;
 
-        //tetris_apply_gravity(game);
-        register_input(IE_GRAVITY, game);
+        // Gravity on a piece that can't fall is what locks it
+        if (++c->lock_ticks >= LOCK_DELAY_TICKS) {
+            c->lock_ticks = 0;
+            fall(game);
+        }
+        return;
+    }
 
-        // Reset timer
-        game->counters.gravity_timer -= speed;
+    c->lock_ticks = 0;
+    c->lock_pose = game->current;
+
+    // Past 1G it's several rows a tick, stop at the floor, landing and locking are two things
+    c->gravity += sample_gravity_table(game);
+    while (c->gravity >= GRAVITY_ONE_ROW && !game->game_over) {
+        c->gravity -= GRAVITY_ONE_ROW;
+        fall(game);
+
+        if (grounded(game)) {
+            c->gravity = 0;
+            break;
+        }
     }
+}
 
-    // Process input queue
+void tetris_update(tetris_board* game, uint32_t ticks) {
+
+    // Whatever was registered since last time happened before these ticks
     tetris_process_input_queue(game);
+
+    for (uint32_t i = 0; i < ticks && !game->game_over; i++)
+        tetris_tick(game);
+}
+
+uint32_t tick_clock_advance(tick_clock* clock, uint32_t us) {
+    return tick_clock_advance_at(clock, us, TETRIS_TICK_RATE);
+}
+
+uint32_t tick_clock_advance_at(tick_clock* clock, uint32_t us, uint32_t rate) {
+
+    clock->remainder += (uint64_t) us * rate;
+
+    uint32_t ticks = (uint32_t) (clock->remainder / 1000000);
+    clock->remainder -= (uint64_t) ticks * 1000000;
+    return ticks;
 }
 
 char index_cell(const tetris_board* game, unsigned int x, unsigned int y) {
@@ -463,6 +628,90 @@ void tetris_destroy(tetris_board *game) {
     free(game->board);
 }
 
+void tetris_save_snapshot(const tetris_board* game, tetris_snapshot* out) {
+
+    assert(game->board != NULL);
+    assert(game->rows * game->cols <= ROWS * COLS);
+
+    // Zero everything, padding included, so snapshots can be memcmp'd
+    memset(out, 0, sizeof(*out));
+    memcpy(out->board, game->board, game->rows * game->cols);
+
+    out->rng = game->rng;
+    out->current = game->current;
+    out->next = game->next;
+    out->hold = game->hold;
+
+    out->points = game->points;
+    out->level = game->level;
+    out->level_goal = game->level_goal;
+    out->stats = game->stats;
+
+    out->lock_grace_counter = game->lock_grace_counter;
+    out->game_over = game->game_over;
+    out->has_held = game->has_held;
+    out->has_hold = game->has_hold;
+
+    out->rotations_tried = game->counters.rotations_tried;
+    out->old_rot = game->counters.old_rot;
+}
+
+void tetris_load_snapshot(tetris_board* game, const tetris_snapshot* in) {
+
+    assert(game->board != NULL);
+    assert(game->rows * game->cols <= ROWS * COLS);
+
+    memcpy(game->board, in->board, game->rows * game->cols);
+    rehash_cells(game);
+
+    game->rng = in->rng;
+    game->current = in->current;
+    game->next = in->next;
+    game->hold = in->hold;
+
+    game->points = in->points;
+    game->level = in->level;
+    game->level_goal = in->level_goal;
+    game->stats = in->stats;
+
+    game->lock_grace_counter = in->lock_grace_counter;
+    game->game_over = in->game_over;
+    game->has_held = in->has_held;
+    game->has_hold = in->has_hold;
+
+    game->counters.rotations_tried = in->rotations_tried;
+    game->counters.old_rot = in->old_rot;
+}
+
+static uint64_t piece_word(const tetromino* t) {
+    return (uint64_t) t->type | (uint64_t) t->rot << 4 | (uint64_t) (uint8_t) t->pos.x << 8 | (uint64_t) (uint8_t) t->pos.y << 16;
+}
+
+uint64_t tetris_state_hash(const tetris_board* game) {
+
+    // Same fields as a snapshot, the few that aren't cells are cheaper to mix in every time
+    // than to keep up to date on every move
+    uint64_t words[] = {
+        game->rng.seed,
+        piece_word(&game->current),
+        piece_word(&game->next),
+        piece_word(&game->hold),
+        (uint64_t) game->points << 32 | game->level,
+        (uint64_t) game->level_goal << 32 | game->stats.lines_cleared,
+        (uint64_t) game->stats.singles << 32 | game->stats.doubles,
+        (uint64_t) game->stats.triples << 32 | game->stats.tetris,
+        (uint64_t) (uint16_t) game->lock_grace_counter |
+            (uint64_t) game->game_over << 16 | (uint64_t) game->has_held << 24 | (uint64_t) game->has_hold << 32 |
+            (uint64_t) (uint8_t) game->counters.rotations_tried << 40 | (uint64_t) (uint8_t) game->counters.old_rot << 48,
+    };
+
+    uint64_t hash = game->cells_hash;
+    for (size_t i = 0; i < sizeof(words) / sizeof(words[0]); i++)
+        hash = splitmix64(hash ^ words[i]);
+
+    return hash;
+}
+
 position calculate_drop_preview(tetromino* piece, tetris_board* game) {
 
     tetromino preview = *piece;
@@ -479,8 +728,17 @@ position calculate_drop_preview(tetromino* piece, tetris_board* game) {
 }
 
 // Tetris events
+/**
+ * @brief Moving a piece that's on the ground uses up one of its lock delay resets
+ */
+static void count_lock_reset(tetris_board* game) {
+    if (grounded(game) && game->lock_grace_counter <= LOCK_MAX_RESETS)
+        game->lock_grace_counter++;
+}
+
 void tetris_move(tetris_board* game, int direction) {
-    move_tetromino(game, &game->current, direction, 0);
+    if (move_tetromino(game, &game->current, direction, 0) == 1)
+        count_lock_reset(game);
 }
 
 void tetris_rotate(tetris_board* game, rot_dir dir) {
@@ -511,23 +769,20 @@ void tetris_rotate(tetris_board* game, rot_dir dir) {
             piece->rot = game->counters.old_rot;
             game->counters.rotations_tried = 0;
         }
+    } else {
+        count_lock_reset(game);
     }
 }
 
 void tetris_apply_gravity(tetris_board* game) {
 
     // Move current piece down by one
+    // Whoever sent it already waited out the lock delay if it can't, see tetris_tick
     if(!move_tetromino(game, &game->current, 0, 1)) {
-
-        game->lock_grace_counter++;
-
-        // Piece placement grace
-        if (game->lock_grace_counter >= 2) {
-            lock_piece(game, &game->current);
-            game->lock_grace_counter = 0;
-        }
+        lock_piece(game, &game->current);
+        game->lock_grace_counter = 0;
     } else {
-        // On successful down move reset grace counter
+        // On successful down move the piece gets all its resets back
         game->lock_grace_counter = 0;
     }
 }
@@ -6,12 +6,15 @@
 #ifndef TETRIS_H
 #define TETRIS_H
 
-#include "queue/queue.h"
+#include "queue/ring.h"
 #include "rng.h"
 #include "input.h"
 
+#include <stdint.h>
+
 typedef struct packet_types packet_types_t;
 typedef struct udp_client udp_client;
+struct replay_recorder;
 
 #define ROWS 20
 #define COLS 10
@@ -20,7 +23,34 @@ typedef struct udp_client udp_client;
 #define NUM_TETROMINOS 7
 #define NUM_ORIENTATIONS 4
 
-#define NUM_LEVELS 19 + 1
+#define NUM_LEVELS 20 + 1
+
+/**
+ * The simulation only ever moves in whole ticks, never by frame time, so the same inputs
+ * play out the same at any frame rate on any machine. Ten of them per 60 Hz frame
+ */
+#define TETRIS_TICK_RATE 600
+#define TICKS_PER_FRAME (TETRIS_TICK_RATE / 60)
+
+// Gravity is fixed point, 1/65536ths of a row per tick
+#define GRAVITY_ONE_ROW 65536u
+// Guideline style, G is rows per 60 Hz frame
+#define GRAVITY_G(g) ((uint32_t) ((g) * GRAVITY_ONE_ROW / TICKS_PER_FRAME))
+// From seconds per row, rounded, only ever used on constants
+#define GRAVITY_FROM_SECONDS(s) ((uint32_t) (GRAVITY_ONE_ROW / ((s) * TETRIS_TICK_RATE) + 0.5))
+
+// A piece on the ground locks this long after it got there, moving or rotating it
+// starts the wait over, but only so many times per piece
+#define LOCK_DELAY_TICKS (TETRIS_TICK_RATE / 2)
+#define LOCK_MAX_RESETS 15
+
+// Auto shift, how long a direction is held before it repeats and then how often
+// An ARR of 0 shifts all the way at once
+#define DEFAULT_DAS_TICKS (10 * TICKS_PER_FRAME)
+#define DEFAULT_ARR_TICKS (2 * TICKS_PER_FRAME)
+
+// Registered inputs kept around until the server acks them, power of two
+#define INPUT_HISTORY_SIZE 32
 
 typedef enum {
     TET_I = 1, TET_J = 2, TET_L = 3, TET_O = 4, TET_S = 5, TET_T = 6, TET_Z = 7, TET_GARBAGE = 8
@@ -43,6 +73,62 @@ typedef struct
     position pos;  
 } tetromino;
 
+// Game statistics
+typedef struct {
+    unsigned int lines_cleared;
+    unsigned int singles;
+    unsigned int doubles;
+    unsigned int triples;
+    unsigned int tetris;
+} tetris_stats;
+
+/**
+ * Everything the simulation depends on, as plain data
+ * so it can be copied around, sent over the wire and compared.
+ * Frame timers are not in here, they only drive local gravity input
+ */
+typedef struct {
+    char board[ROWS * COLS];
+
+    rng_table rng;
+    tetromino current;
+    tetromino next;
+    tetromino hold;
+
+    unsigned int points;
+    unsigned int level;
+    unsigned int level_goal;
+    tetris_stats stats;
+
+    short lock_grace_counter;
+    char game_over;
+    char has_held;
+    char has_hold;
+
+    char rotations_tried;
+    char old_rot;
+} tetris_snapshot;
+
+// Where the local clock is at, only tetris_update looks at these
+typedef struct {
+    uint32_t tick; // Ticks simulated so far
+    uint32_t gravity; // Fixed point, how far the piece has fallen since the last whole row
+    uint32_t lock_ticks; // How long the piece has been on the ground
+    tetromino lock_pose; // Where it was last tick, moving it resets the lock delay
+
+    char rotations_tried;
+    char old_rot;
+
+    // Only for effects, nothing in the game depends on them
+    uint32_t clear_rows; // Bit per row the last line clear took, where they were
+    uint32_t clear_tick; // Tick it happened on
+} tetris_counters;
+
+// Real time to whole ticks, whatever doesn't make a whole one carries over to the next call
+typedef struct {
+    uint64_t remainder;
+} tick_clock;
+
 // Game board
 typedef struct tetris_board {
 
@@ -66,42 +152,44 @@ typedef struct tetris_board {
     char has_held; // Has the player used hold this turn?
     char has_hold; // Is the player holding anything?
 
-    short lock_grace_counter; // Lock grace period counter
+    short lock_grace_counter; // Lock delay resets the current piece used up
 
     // The current board state
     char* board;
 
+    // Only ever written through set_cell, which keeps these up to date
+    uint64_t cells_hash; // Zobrist hash of the locked cells, see tetris_state_hash
+    uint32_t board_version; // Bumped on every locked cell change
+
     // Game statistics
-    struct {
-        unsigned int lines_cleared;
-        unsigned int singles;
-        unsigned int doubles;
-        unsigned int triples;
-        unsigned int tetris;
-    } stats;
+    tetris_stats stats;
 
     // General counters
-    struct {
-        float move_timer;
-        float drop_timer;
-        float gravity_timer;
-
-        char rotations_tried;
-        char old_rot;
-
-    } counters;
+    tetris_counters counters;
 
     /**
      * An input queue should make sure no inputs are dropped 
      * and also useful to build a Quake3 inspired input history
      * To store replays
+     *
+     * The ring itself takes pushes from any thread, but register_input also checks the
+     * validator and numbers the input for the server without a lock, so only the thread
+     * stepping the board (the sim thread) registers. Other threads hand it their events
      */
-    queue input_queue;
+    mpsc_ring input_queue;
+    uint16_t input_seq; // Sequence of the next locally registered input
+
+    // Every applied input is written here if set, see replay.h
+    struct replay_recorder* recorder;
     input_validator_t validator; // Verify input validity
 
     // Game settings
     struct {
         unsigned int preview_count;
+
+        // Handling, in ticks, for input providers that repeat held directions
+        uint32_t das;
+        uint32_t arr;
     } settings;
 
     /**
@@ -111,6 +199,28 @@ typedef struct tetris_board {
      */
     udp_client* server;
 
+    // Network session, only meaningful while bound to a server
+    struct {
+        unsigned char player_id; // Id of this board on the client socket
+        uint32_t start_time; // Input times are sent relative to this
+
+        // Inputs are numbered and go out once per frame, along with every
+        // input the server hasn't acked yet, so a lost packet costs nothing
+        uint32_t next_seq; // Sequence of the next registered input
+        uint32_t flushed_seq; // Everything bellow this was sent at least once
+        uint32_t acked_seq; // Everything bellow this reached the server
+        uint32_t last_send_time;
+
+        unsigned char history_action[INPUT_HISTORY_SIZE];
+        uint32_t history_time[INPUT_HISTORY_SIZE];
+
+        // Client side prediction, the state right after each input was applied locally
+        // When the server's state for an input disagrees we rewind and replay from there
+        uint32_t applied_seq; // Inputs bellow this were applied locally
+        tetris_snapshot predicted[INPUT_HISTORY_SIZE];
+        unsigned int mispredictions;
+    } net;
+
 } tetris_board;
 
 /*
@@ -123,16 +233,32 @@ typedef struct tetris_board {
 extern position TETROMINOS[NUM_TETROMINOS][NUM_ORIENTATIONS][TETRIS];
 
 /**
- * The speed at which pieces gravity ticks at each levels
- * This speed is given in seconds
+ * Gravity at each level, fixed point rows per tick, see GRAVITY_ONE_ROW
  */
-extern float LEVEL_SPEED[NUM_LEVELS];
+extern uint32_t LEVEL_GRAVITY[NUM_LEVELS];
 
 void tetris_init(tetris_board* game, int rows, int cols, unsigned int seed, char* name); // Start a tetris board
-void tetris_update(tetris_board* game, float dt);
+
+// Apply what's queued up, then simulate this many ticks
+void tetris_update(tetris_board* game, uint32_t ticks);
+
+// Ticks that fit in `us` microseconds plus whatever was left over last time
+uint32_t tick_clock_advance(tick_clock* clock, uint32_t us);
+// Same for a clock that doesn't tick at TETRIS_TICK_RATE, keep using the same rate with it
+uint32_t tick_clock_advance_at(tick_clock* clock, uint32_t us, uint32_t rate);
+
 void tetris_process_input_queue(tetris_board* game);
+void tetris_apply_input(tetris_board* game, input_event_type action);
 void tetris_destroy(tetris_board* game);
 
+// Copy the simulation state out of and back into a board
+void tetris_save_snapshot(const tetris_board* game, tetris_snapshot* out);
+void tetris_load_snapshot(tetris_board* game, const tetris_snapshot* in);
+
+// Hash of everything a snapshot holds, boards that hash the same are in the same state
+// The cells are hashed incrementally as they change, so this is a handful of mixes
+uint64_t tetris_state_hash(const tetris_board* game);
+
 // Bind a game to a socket, aka start dupping input into the socket
 void tetris_bind_game(tetris_board* game, udp_client* client);
 
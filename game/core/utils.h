@@ -9,5 +9,7 @@
 #include <stdint.h>
 
 uint32_t now_ms(void);
+// Same clock, finer, now_us() / 1000 truncates to what now_ms() gives
+uint64_t now_us(void);
 
 #endif
\ No newline at end of file
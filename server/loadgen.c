@@ -0,0 +1,327 @@
+/**
+ * @file        loadgen.c
+ * @brief       Load generator, a lot of headless clients hammering a server
+ *
+ * Every virtual client is a real udp_client with its own socket and a board running
+ * the engine, fed by a scripted random input stream. They connect, play for a while
+ * and disconnect, a few threads tick all of them at the game's frame rate.
+ *
+ * Latency is measured per input, from the moment it's registered to the moment the
+ * server's state acks it, so it covers the whole round trip through the server tick.
+ * Inputs that never get acked by the end are counted as dropped.
+ *
+ * The server seats MAX_LOBBIES matches of two, clients past that are rejected. Those are
+ * reported on their own and their inputs don't count as drops, it's capacity, not loss.
+ */
+
+#include "tetris.h"
+#include "input.h"
+#include "rng.h"
+#include "utils.h"
+#include "net/client.h"
+#include "lib/tinycthread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#define DEFAULT_CLIENTS 1000
+#define DEFAULT_THREADS 4
+#define DEFAULT_SECONDS 10
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 5000
+
+#define FRAME_MS 16
+#define INPUTS_PER_SECOND 8 // Per client, on top of gravity
+#define DRAIN_MS 1000 // After disconnecting, for the last acks to come in
+
+// Input to state latency, 1ms buckets, the last one takes everything slower
+#define LATENCY_BUCKETS 2001
+
+static const input_event_type SCRIPT_ACTIONS[] = {
+    IE_MOVE_LEFT, IE_MOVE_RIGHT, IE_ROTATE_LEFT, IE_ROTATE_RIGHT, IE_DROP, IE_HARD_DROP,
+};
+#define NUM_SCRIPT_ACTIONS (sizeof(SCRIPT_ACTIONS) / sizeof(SCRIPT_ACTIONS[0]))
+
+typedef struct {
+    udp_client client;
+    tetris_board board;
+    rng_table rng;
+    tick_clock clock;
+    char name[16];
+
+    uint32_t measured_seq; // Inputs bellow this have had their latency taken
+    char served; // Got at least one state back
+    char rejected; // The server had no room, the board got unbound
+} virtual_client_t;
+
+typedef struct {
+    virtual_client_t* clients;
+    int count;
+    uint32_t end_time;
+
+    // Everything bellow is only touched by the thread, summed up once it's joined
+    uint64_t inputs; // Of clients that weren't rejected
+    uint64_t acked;
+    uint64_t served_inputs;
+    uint64_t served_acked;
+    unsigned int served;
+    unsigned int rejected;
+    uint64_t sent;
+    uint64_t received;
+    uint32_t latency[LATENCY_BUCKETS];
+} worker_t;
+
+static const char* host = DEFAULT_HOST;
+static int port = DEFAULT_PORT;
+
+// Latency of everything the server acked since last time
+static void measure_acks(worker_t* w, virtual_client_t* vc, uint32_t now) {
+
+    tetris_board* board = &vc->board;
+    uint32_t acked = board->net.acked_seq;
+
+    for (; vc->measured_seq != acked; vc->measured_seq++) {
+
+        // Registered too long ago, its time got overwritten
+        if (board->net.next_seq - vc->measured_seq > INPUT_HISTORY_SIZE)
+            continue;
+
+        uint32_t registered = board->net.start_time + board->net.history_time[vc->measured_seq & (INPUT_HISTORY_SIZE - 1)];
+        uint32_t latency = now - registered;
+        w->latency[latency < LATENCY_BUCKETS - 1 ? latency : LATENCY_BUCKETS - 1]++;
+    }
+
+    vc->served |= acked != 0;
+}
+
+static void play(virtual_client_t* vc) {
+
+    tetris_board* board = &vc->board;
+
+    // Start over, through the server so it stays in sync
+    if (board->game_over) {
+        register_input(IE_RESET, board);
+        tetris_process_input_queue(board);
+        return;
+    }
+
+    if (rng_step(&vc->rng) % (1000 / FRAME_MS) < INPUTS_PER_SECOND)
+        register_input(SCRIPT_ACTIONS[rng_step(&vc->rng) % NUM_SCRIPT_ACTIONS], board);
+
+    tetris_update(board, tick_clock_advance(&vc->clock, FRAME_MS * 1000));
+}
+
+static int worker(void* arg) {
+
+    worker_t* w = (worker_t*) arg;
+
+    // Connect everyone
+    for (int i = 0; i < w->count; i++) {
+        virtual_client_t* vc = &w->clients[i];
+        tetris_bind_game(&vc->board, &vc->client);
+    }
+
+    // Play until time's up, then say bye and give the server a moment to answer
+    char playing = 1;
+    uint32_t drain_end = 0;
+    uint32_t next_frame = now_ms();
+
+    while (playing || (int32_t) (now_ms() - drain_end) < 0) {
+
+        uint32_t now = now_ms();
+        if (playing && (int32_t) (now - w->end_time) >= 0) {
+            for (int i = 0; i < w->count; i++)
+                tetris_bind_game(&w->clients[i].board, NULL);
+
+            playing = 0;
+            drain_end = now + DRAIN_MS;
+        }
+
+        for (int i = 0; i < w->count; i++) {
+
+            virtual_client_t* vc = &w->clients[i];
+            client_poll(&vc->client);
+            measure_acks(w, vc, now_ms());
+
+            // Their inputs stop going anywhere, nothing to measure
+            if (playing && !vc->board.server)
+                vc->rejected = 1;
+
+            if (playing && !vc->rejected) {
+                play(vc);
+                flush_inputs(&vc->board);
+            }
+        }
+
+        // Sleep off whatever is left of the frame, if we're behind just keep going
+        next_frame += FRAME_MS;
+        int32_t left = (int32_t) (next_frame - now_ms());
+        if (left > 0)
+            thrd_sleep(&(struct timespec) { .tv_sec = 0, .tv_nsec = left * 1000000L }, NULL);
+        else
+            next_frame = now_ms();
+    }
+
+    for (int i = 0; i < w->count; i++) {
+
+        virtual_client_t* vc = &w->clients[i];
+        tetris_board* board = &vc->board;
+
+        w->sent += atomic_load(&vc->client.packets_sent);
+        w->received += vc->client.packets_received;
+
+        if (vc->rejected) {
+            w->rejected++;
+            continue;
+        }
+
+        w->inputs += board->net.next_seq;
+        w->acked += board->net.acked_seq;
+        if (vc->served) {
+            w->served++;
+            w->served_inputs += board->net.next_seq;
+            w->served_acked += board->net.acked_seq;
+        }
+    }
+
+    return 0;
+}
+
+// Smallest latency at least `fraction` of the samples are under
+static unsigned int percentile(const uint64_t* histogram, uint64_t total, double fraction) {
+
+    uint64_t target = (uint64_t) (total * fraction);
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen > target)
+            return i;
+    }
+
+    return LATENCY_BUCKETS - 1;
+}
+
+static double drop_rate(uint64_t inputs, uint64_t acked) {
+    return inputs ? 100.0 * (inputs - acked) / inputs : 0.0;
+}
+
+int main(int argc, char** argv) {
+
+    int clients = argc > 1 ? atoi(argv[1]) : DEFAULT_CLIENTS;
+    int threads = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+    int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+    if (argc > 4) host = argv[4];
+    if (argc > 5) port = atoi(argv[5]);
+
+    if (clients <= 0 || threads <= 0 || seconds <= 0) {
+        fprintf(stderr, "usage: %s [clients] [threads] [seconds] [host] [port]\n", argv[0]);
+        return 1;
+    }
+    if (threads > clients)
+        threads = clients;
+
+    // A socket per client, that goes past the default limit quickly
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    virtual_client_t* all = calloc(clients, sizeof(virtual_client_t));
+    worker_t* workers = calloc(threads, sizeof(worker_t));
+    thrd_t* handles = calloc(threads, sizeof(thrd_t));
+    if (!all || !workers || !handles) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for (int i = 0; i < clients; i++) {
+        virtual_client_t* vc = &all[i];
+        if (client_init(&vc->client, host, port)) {
+            fprintf(stderr, "Could only open %d clients\n", i);
+            clients = i;
+            break;
+        }
+
+        snprintf(vc->name, sizeof(vc->name), "load%d", i);
+        // Same seed the server starts everyone on, anything else is a desync from the first piece
+        tetris_init(&vc->board, ROWS, COLS, 0, vc->name);
+        rng_init(&vc->rng, i + 1);
+    }
+
+    printf("%d clients on %d threads against %s:%d for %ds\n", clients, threads, host, port, seconds);
+
+    uint32_t start = now_ms();
+    int given = 0;
+    for (int t = 0; t < threads; t++) {
+        worker_t* w = &workers[t];
+        w->clients = &all[given];
+        w->count = clients / threads + (t < clients % threads);
+        w->end_time = start + seconds * 1000;
+        given += w->count;
+
+        thrd_create(&handles[t], worker, w);
+    }
+
+    for (int t = 0; t < threads; t++)
+        thrd_join(handles[t], NULL);
+
+    float elapsed = (now_ms() - start) / 1000.0f;
+
+    // Sum it all up
+    uint64_t inputs = 0, acked = 0, served_inputs = 0, served_acked = 0, sent = 0, received = 0;
+    unsigned int served = 0, rejected = 0;
+    static uint64_t latency[LATENCY_BUCKETS];
+    for (int t = 0; t < threads; t++) {
+        worker_t* w = &workers[t];
+        inputs += w->inputs;
+        acked += w->acked;
+        served_inputs += w->served_inputs;
+        served_acked += w->served_acked;
+        served += w->served;
+        rejected += w->rejected;
+        sent += w->sent;
+        received += w->received;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            latency[i] += w->latency[i];
+    }
+
+    uint64_t samples = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        samples += latency[i];
+
+    printf("\n");
+    printf("clients served   %u / %d, %u rejected (server full), %d never answered\n",
+        served, clients, rejected, clients - (int) served - (int) rejected);
+    printf("packets sent     %llu (%.0f/s)\n", (unsigned long long) sent, sent / elapsed);
+    printf("packets received %llu (%.0f/s)\n", (unsigned long long) received, received / elapsed);
+    printf("inputs           %llu, %llu acked\n", (unsigned long long) inputs, (unsigned long long) acked);
+    printf("drop rate        %.2f%% of accepted clients, %.2f%% of served clients\n",
+        drop_rate(inputs, acked), drop_rate(served_inputs, served_acked));
+
+    if (samples) {
+        unsigned int max = LATENCY_BUCKETS - 1;
+        while (!latency[max])
+            max--;
+
+        printf("input latency    p50 %ums  p90 %ums  p99 %ums  p99.9 %ums  max %u%sms\n",
+            percentile(latency, samples, 0.50),
+            percentile(latency, samples, 0.90),
+            percentile(latency, samples, 0.99),
+            percentile(latency, samples, 0.999),
+            max, max == LATENCY_BUCKETS - 1 ? "+" : "");
+    }
+
+    for (int i = 0; i < clients; i++) {
+        tetris_destroy(&all[i].board);
+        client_destroy(&all[i].client);
+    }
+
+    free(handles);
+    free(workers);
+    free(all);
+
+    return 0;
+}
@@ -0,0 +1,123 @@
+/**
+ * @file        replay_verify.c
+ * @brief       Plays every replay in an archive back and checks it still ends the same way
+ *
+ * An archive entry carries the hash of the board as it was when the game was actually
+ * played. Replaying it with the current engine has to land on the exact same board, if it
+ * doesn't something made the simulation non deterministic, or changed what it does.
+ *
+ * Entries are handed out to the threads one at a time, none of them share anything but
+ * the read only mapping. Since it's nothing but simulation it's also how fast the engine
+ * runs, replays and inputs per second are reported at the end.
+ */
+
+#include "replay_archive.h"
+#include "utils.h"
+#include "lib/tinycthread.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define DEFAULT_ARCHIVE "matches.nta"
+#define MAX_REPORTED 20 // Mismatches listed one by one, the rest are only counted
+
+typedef struct {
+    const replay_archive* archive;
+    _Atomic uint32_t next;
+
+    // Per entry, filled in by whichever thread played it
+    uint64_t* hashes;
+    char* broken;
+} job_t;
+
+static int worker(void* arg) {
+
+    job_t* job = (job_t*) arg;
+
+    for (;;) {
+        uint32_t i = atomic_fetch_add(&job->next, 1);
+        if (i >= job->archive->count)
+            break;
+
+        job->broken[i] = replay_archive_verify(job->archive, i, &job->hashes[i]) != 0;
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    const char* path = argc > 1 ? argv[1] : DEFAULT_ARCHIVE;
+    long threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    replay_archive archive;
+    if (replay_archive_open(&archive, path)) {
+        fprintf(stderr, "usage: %s [archive] [threads], can't open %s\n", argv[0], path);
+        return 1;
+    }
+
+    job_t job = {
+        .archive = &archive,
+        .hashes = calloc(archive.count ? archive.count : 1, sizeof(uint64_t)),
+        .broken = calloc(archive.count ? archive.count : 1, 1),
+    };
+    atomic_init(&job.next, 0);
+
+    thrd_t* handles = calloc(threads, sizeof(thrd_t));
+    if (!job.hashes || !job.broken || !handles) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    printf("%u replays from %s on %ld threads\n", archive.count, path, threads);
+
+    uint32_t start = now_ms();
+    for (long t = 0; t < threads; t++)
+        thrd_create(&handles[t], worker, &job);
+    for (long t = 0; t < threads; t++)
+        thrd_join(handles[t], NULL);
+
+    float elapsed = (now_ms() - start) / 1000.0f;
+
+    // Report in archive order, whatever order they were played in
+    uint32_t mismatches = 0, broken = 0;
+    uint64_t inputs = 0, ticks = 0;
+    for (uint32_t i = 0; i < archive.count; i++) {
+
+        const replay_archive_entry* e = &archive.entries[i];
+        inputs += e->inputs;
+        ticks += e->length;
+
+        if (job.broken[i]) {
+            if (broken++ + mismatches < MAX_REPORTED)
+                printf("  #%u seed %u doesn't parse\n", i, e->seed);
+            continue;
+        }
+
+        if (job.hashes[i] != e->final_hash) {
+            if (mismatches++ + broken < MAX_REPORTED)
+                printf("  #%u seed %u, %u inputs: expected %016llx got %016llx\n", i, e->seed, e->inputs,
+                    (unsigned long long) e->final_hash, (unsigned long long) job.hashes[i]);
+        }
+    }
+
+    if (elapsed <= 0.0f)
+        elapsed = 0.001f;
+
+    printf("\n");
+    printf("mismatches       %u / %u\n", mismatches, archive.count);
+    printf("unreadable       %u\n", broken);
+    printf("played           %.1f minutes of games in %.3fs\n", ticks / (float) REPLAY_TICK_RATE / 60.0f, elapsed);
+    printf("throughput       %.0f replays/s, %.0f inputs/s\n", archive.count / elapsed, inputs / elapsed);
+
+    free(handles);
+    free(job.hashes);
+    free(job.broken);
+    replay_archive_close(&archive);
+
+    return mismatches || broken;
+}